@@ -0,0 +1,797 @@
+/*
+ * critbit89 - A crit-bit tree implementation for strings in C89
+ * Written by Jonas Gehring <jonas@jgehring.net>
+ */
+
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "critbit.h"
+#include "critbit32.h"
+
+
+#define DEFAULT_KEYS 100000
+#define LOOKUP_ROUNDS 10
+#define BATCH_SIZE 256
+#define MAX_THREADS 8
+#define MAX_WRITERS 64
+
+static size_t nkeys = DEFAULT_KEYS;
+static char **keys;
+
+/* Returns the elapsed time since start in nanoseconds per operation */
+static double ns_per_op(clock_t start, size_t ops)
+{
+	double secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+	return secs * 1e9 / (double)ops;
+}
+
+/* Returns the wall clock time in seconds */
+static double wall_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Generates URL-like keys of about len bytes sharing a common prefix */
+static void make_keys(size_t len)
+{
+	static const char *prefix = "https://www.example.com/catalog/items/";
+	size_t plen = strlen(prefix);
+	size_t i, j;
+
+	if (plen > len / 2) {
+		plen = len < 16 ? 0 : len / 2;
+	}
+
+	keys = (char **)malloc(nkeys * sizeof(char *));
+	for (i = 0; i < nkeys; i++) {
+		keys[i] = (char *)malloc(len + 1);
+		memcpy(keys[i], prefix, plen);
+		for (j = plen; j < len; j++) {
+			keys[i][j] = 'a' + rand() % 26;
+		}
+		keys[i][len] = '\0';
+	}
+}
+
+static void free_keys(void)
+{
+	size_t i;
+	for (i = 0; i < nkeys; i++) {
+		free(keys[i]);
+	}
+	free(keys);
+}
+
+/* Lookups of present keys */
+static void bench_contains(size_t len)
+{
+	cb_tree_t tree = cb_tree_make();
+	clock_t start;
+	size_t i, r, found = 0;
+
+	make_keys(len);
+	start = clock();
+	for (i = 0; i < nkeys; i++) {
+		cb_tree_insert(&tree, keys[i]);
+	}
+	printf("insert   %4d-byte keys: %8.1f ns/op\n", (int)len,
+		ns_per_op(start, nkeys));
+
+	start = clock();
+	for (r = 0; r < LOOKUP_ROUNDS; r++) {
+		for (i = 0; i < nkeys; i++) {
+			found += cb_tree_contains(&tree, keys[(i * 7919) % nkeys]);
+		}
+	}
+	printf("contains %4d-byte keys: %8.1f ns/op\n", (int)len,
+		ns_per_op(start, nkeys * LOOKUP_ROUNDS));
+
+	if (found != nkeys * LOOKUP_ROUNDS) {
+		fprintf(stderr, "%d lookups failed\n", (int)(nkeys * LOOKUP_ROUNDS - found));
+		abort();
+	}
+
+	cb_tree_clear(&tree);
+	free_keys();
+}
+
+/* Insertion and deletion, with allocation costs kept low by an arena */
+static void bench_insert(size_t len)
+{
+	cb_tree_t tree = cb_tree_make();
+	cb_arena_t arena = cb_arena_make(0);
+	clock_t start;
+	size_t i;
+
+	make_keys(len);
+	cb_tree_use_arena(&tree, &arena);
+	start = clock();
+	for (i = 0; i < nkeys; i++) {
+		cb_tree_insert(&tree, keys[i]);
+	}
+	printf("insert   %4d-byte keys, arena : %8.1f ns/op\n", (int)len,
+		ns_per_op(start, nkeys));
+
+	start = clock();
+	for (i = 0; i < nkeys; i++) {
+		cb_tree_delete(&tree, keys[(i * 7919) % nkeys]);
+	}
+	printf("delete   %4d-byte keys, arena : %8.1f ns/op\n", (int)len,
+		ns_per_op(start, nkeys));
+	cb_tree_clear(&tree);
+	free_keys();
+}
+
+/* Lookups one at a time and in batches */
+static void bench_batch(size_t len)
+{
+	cb_tree_t tree = cb_tree_make();
+	const void *batch[BATCH_SIZE];
+	int results[BATCH_SIZE];
+	clock_t start;
+	size_t i, j, r, found = 0;
+
+	make_keys(len);
+	for (i = 0; i < nkeys; i++) {
+		cb_tree_insert(&tree, keys[i]);
+	}
+
+	start = clock();
+	for (r = 0; r < LOOKUP_ROUNDS; r++) {
+		for (i = 0; i < nkeys; i++) {
+			found += cb_tree_contains(&tree, keys[(i * 7919) % nkeys]);
+		}
+	}
+	printf("contains %4d-byte keys, single: %8.1f ns/op\n", (int)len,
+		ns_per_op(start, nkeys * LOOKUP_ROUNDS));
+
+	start = clock();
+	for (r = 0; r < LOOKUP_ROUNDS; r++) {
+		for (i = 0; i < nkeys; i += BATCH_SIZE) {
+			size_t n = nkeys - i < BATCH_SIZE ? nkeys - i : BATCH_SIZE;
+			for (j = 0; j < n; j++) {
+				batch[j] = keys[((i + j) * 7919) % nkeys];
+			}
+			found += cb_tree_contains_batch(&tree, batch, NULL, n, results);
+		}
+	}
+	printf("contains %4d-byte keys, batch : %8.1f ns/op\n", (int)len,
+		ns_per_op(start, nkeys * LOOKUP_ROUNDS));
+
+	if (found != 2 * nkeys * LOOKUP_ROUNDS) {
+		fprintf(stderr, "%d lookups failed\n", (int)(2 * nkeys * LOOKUP_ROUNDS - found));
+		abort();
+	}
+
+	cb_tree_clear(&tree);
+	free_keys();
+}
+
+/* Longest prefix matches of keys against shorter stored rules */
+static void bench_longest_prefix(size_t len)
+{
+	cb_tree_t tree = cb_tree_make();
+	clock_t start;
+	size_t i, r, found = 0;
+	int a;
+
+	make_keys(len);
+	for (i = 0; i < nkeys; i++) {
+		cb_tree_insert_n(&tree, keys[i], len / 2 + (size_t)rand() % (len / 2));
+	}
+
+	for (a = 0; a < 2; a++) {
+		const char *name = a ? "lpm" : "shrink";
+		start = clock();
+		for (r = 0; r < LOOKUP_ROUNDS; r++) {
+			for (i = 0; i < nkeys; i++) {
+				const char *key = keys[(i * 7919) % nkeys];
+				size_t l;
+				if (a) {
+					found += cb_tree_longest_prefix_n(&tree, key, len, &l) != NULL;
+					continue;
+				}
+				for (l = len + 1; l-- > 0; ) {
+					if (cb_tree_contains_n(&tree, key, l)) {
+						found++;
+						break;
+					}
+				}
+			}
+		}
+		printf("prefix   %4d-byte keys, %-6s: %8.1f ns/op\n", (int)len, name,
+			ns_per_op(start, nkeys * LOOKUP_ROUNDS));
+	}
+
+	if (found != 2 * nkeys * LOOKUP_ROUNDS) {
+		fprintf(stderr, "%d lookups failed\n", (int)(2 * nkeys * LOOKUP_ROUNDS - found));
+		abort();
+	}
+
+	cb_tree_clear(&tree);
+	free_keys();
+}
+
+static int strcmp_cb(const void *a, const void *b)
+{
+	return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+/* Loading sorted keys by insertion and by building */
+static void bench_build(size_t len)
+{
+	cb_tree_t tree = cb_tree_make();
+	clock_t start;
+	size_t i;
+
+	make_keys(len);
+	qsort(keys, nkeys, sizeof(keys[0]), strcmp_cb);
+
+	start = clock();
+	for (i = 0; i < nkeys; i++) {
+		cb_tree_insert(&tree, keys[i]);
+	}
+	printf("load     %4d-byte keys, insert: %8.1f ns/key\n", (int)len,
+		ns_per_op(start, nkeys));
+	cb_tree_clear(&tree);
+
+	start = clock();
+	if (cb_tree_build_sorted(&tree, (const void *const *)keys, NULL, nkeys) != 0) {
+		fprintf(stderr, "Building failed\n");
+		abort();
+	}
+	printf("load     %4d-byte keys, build : %8.1f ns/key\n", (int)len,
+		ns_per_op(start, nkeys));
+	cb_tree_clear(&tree);
+
+	start = clock();
+	if (cb_tree_insert_batch(&tree, (const void *const *)keys, NULL, nkeys, &i) != 0) {
+		fprintf(stderr, "Batch insertion failed\n");
+		abort();
+	}
+	printf("load     %4d-byte keys, batch : %8.1f ns/key\n", (int)len,
+		ns_per_op(start, nkeys));
+	cb_tree_clear(&tree);
+	free_keys();
+}
+
+/* Insertion and clearing with the standard and arena allocators */
+static void bench_clear(size_t len)
+{
+	cb_tree_t tree = cb_tree_make();
+	cb_arena_t arena = cb_arena_make(0);
+	clock_t start;
+	size_t i;
+	int a;
+
+	make_keys(len);
+	for (a = 0; a < 2; a++) {
+		const char *name = a ? "arena" : "malloc";
+		if (a) {
+			cb_tree_use_arena(&tree, &arena);
+		}
+
+		start = clock();
+		for (i = 0; i < nkeys; i++) {
+			cb_tree_insert(&tree, keys[i]);
+		}
+		printf("insert   %4d-byte keys, %-6s: %8.1f ns/op\n", (int)len, name,
+			ns_per_op(start, nkeys));
+
+		start = clock();
+		cb_tree_clear(&tree);
+		printf("clear    %4d-byte keys, %-6s: %8.1f ns/key\n", (int)len, name,
+			ns_per_op(start, nkeys));
+	}
+	free_keys();
+}
+
+/* Deletion and reinsertion churn with the standard and pool allocators */
+static void bench_churn(size_t len)
+{
+	cb_tree_t tree = cb_tree_make();
+	cb_arena_t arena = cb_arena_make(0);
+	clock_t start;
+	size_t i, r;
+	int a;
+
+	make_keys(len);
+	for (a = 0; a < 2; a++) {
+		const char *name = a ? "pool" : "malloc";
+		if (a) {
+			cb_tree_use_pool(&tree, &arena);
+		}
+		for (i = 0; i < nkeys; i++) {
+			cb_tree_insert(&tree, keys[i]);
+		}
+
+		start = clock();
+		for (r = 0; r < LOOKUP_ROUNDS; r++) {
+			for (i = 0; i < nkeys; i++) {
+				size_t k = (size_t)rand() % nkeys;
+				cb_tree_delete(&tree, keys[k]);
+				cb_tree_insert(&tree, keys[k]);
+			}
+		}
+		printf("churn    %4d-byte keys, %-6s: %8.1f ns/op\n", (int)len, name,
+			ns_per_op(start, nkeys * LOOKUP_ROUNDS * 2));
+		cb_tree_clear(&tree);
+	}
+	printf("pool hit rate: %.1f%%\n",
+		100.0 * arena.hits / (double)(arena.hits + arena.misses));
+	free_keys();
+}
+
+/* Allocator counting the bytes in use */
+static void *counting_malloc(size_t size, void *baton)
+{
+	size_t *block = (size_t *)malloc(sizeof(double) + size);
+	*(size_t *)baton += size;
+	*block = size;
+	return (double *)block + 1;
+}
+
+static void counting_free(void *ptr, void *baton)
+{
+	size_t *block = (size_t *)((double *)ptr - 1);
+	*(size_t *)baton -= *block;
+	free(block);
+}
+
+/* Insertion of copied and borrowed keys */
+static void bench_borrowed(size_t len)
+{
+	cb_tree_t tree = cb_tree_make();
+	size_t bytes = 0;
+	clock_t start;
+	size_t i;
+	int a;
+
+	tree.malloc = counting_malloc;
+	tree.free = counting_free;
+	tree.baton = &bytes;
+
+	make_keys(len);
+	for (a = 0; a < 2; a++) {
+		const char *name = a ? "ref" : "copy";
+		start = clock();
+		for (i = 0; i < nkeys; i++) {
+			if (a) {
+				cb_tree_insert_ref(&tree, keys[i]);
+			}
+			else {
+				cb_tree_insert(&tree, keys[i]);
+			}
+		}
+		printf("insert   %4d-byte keys, %-6s: %8.1f ns/op, %5.1f bytes/key\n",
+			(int)len, name, ns_per_op(start, nkeys), (double)bytes / nkeys);
+		cb_tree_clear(&tree);
+	}
+	free_keys();
+}
+
+/* Memory use and lookups of the pointer and index based layouts */
+static void bench_compact(size_t len)
+{
+	static const size_t sizes[] = { 10000, 100000, 1000000, 10000000 };
+	cb_tree_t tree = cb_tree_make();
+	cb32_tree_t ctree = cb32_tree_make();
+	size_t bytes = 0, cbytes = 0;
+	size_t saved = nkeys;
+	clock_t start;
+	size_t i, r, s, found = 0;
+	int a;
+
+	tree.malloc = ctree.malloc = counting_malloc;
+	tree.free = ctree.free = counting_free;
+	tree.baton = &bytes;
+	ctree.baton = &cbytes;
+
+	/* Memory use at several sizes, as the arrays grow in steps */
+	for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		nkeys = sizes[s];
+		make_keys(len);
+		for (i = 0; i < nkeys; i++) {
+			cb_tree_insert(&tree, keys[i]);
+			cb32_tree_insert(&ctree, keys[i]);
+		}
+		printf("size     %4d-byte keys, %8d keys: ptr %6.1f, index %6.1f bytes/key\n",
+			(int)len, (int)nkeys, (double)bytes / nkeys, (double)cbytes / nkeys);
+		cb_tree_clear(&tree);
+		cb32_tree_clear(&ctree);
+		free_keys();
+	}
+	nkeys = saved;
+
+	make_keys(len);
+	for (a = 0; a < 2; a++) {
+		const char *name = a ? "index" : "ptr";
+		for (i = 0; i < nkeys; i++) {
+			if (a) {
+				cb32_tree_insert(&ctree, keys[i]);
+			}
+			else {
+				cb_tree_insert(&tree, keys[i]);
+			}
+		}
+
+		start = clock();
+		for (r = 0; r < LOOKUP_ROUNDS; r++) {
+			for (i = 0; i < nkeys; i++) {
+				const char *key = keys[(i * 7919) % nkeys];
+				found += a ? cb32_tree_contains(&ctree, key) : cb_tree_contains(&tree, key);
+			}
+		}
+		printf("contains %4d-byte keys, %-6s: %8.1f ns/op\n", (int)len, name,
+			ns_per_op(start, nkeys * LOOKUP_ROUNDS));
+		cb_tree_clear(&tree);
+		cb32_tree_clear(&ctree);
+	}
+
+	if (found != 2 * nkeys * LOOKUP_ROUNDS) {
+		fprintf(stderr, "%d lookups failed\n", (int)(2 * nkeys * LOOKUP_ROUNDS - found));
+		abort();
+	}
+	free_keys();
+}
+
+/* Blocks retired by the writer, freed once all readers are done */
+struct retired {
+	void **blocks;
+	size_t n, capacity;
+};
+
+static void retire_cb(void *ptr, void *baton)
+{
+	struct retired *r = (struct retired *)baton;
+	if (r->n == r->capacity) {
+		r->capacity = r->capacity ? 2 * r->capacity : 1024;
+		r->blocks = (void **)realloc(r->blocks, r->capacity * sizeof(void *));
+	}
+	r->blocks[r->n++] = ptr;
+}
+
+struct reader {
+	pthread_t thread;
+	cb_tree_t *tree;
+	size_t offset;
+	size_t found;
+};
+
+static void *reader_main(void *arg)
+{
+	struct reader *r = (struct reader *)arg;
+	size_t i;
+	for (i = 0; i < nkeys * LOOKUP_ROUNDS; i++) {
+		r->found += cb_tree_contains(r->tree, keys[(r->offset + i * 7919) % nkeys]);
+	}
+	return NULL;
+}
+
+static volatile int readers_done;
+
+/* Keeps replacing random keys while the readers run */
+static void *writer_main(void *arg)
+{
+	cb_tree_t *tree = (cb_tree_t *)arg;
+	struct timespec pause = { 0, 100000 };
+	while (!readers_done) {
+		size_t i = (size_t)rand() % nkeys;
+		cb_tree_delete(tree, keys[i]);
+		cb_tree_insert(tree, keys[i]);
+		nanosleep(&pause, NULL);
+	}
+	return NULL;
+}
+
+/* Concurrent lookups from several reader threads during updates */
+static void bench_mt(size_t len)
+{
+	cb_tree_t tree = cb_tree_make();
+	struct retired retired = { NULL, 0, 0 };
+	struct reader readers[MAX_THREADS];
+	pthread_t writer;
+	size_t i, nthreads;
+
+	make_keys(len);
+	tree.baton = &retired;
+	cb_tree_use_rcu(&tree, retire_cb);
+	for (i = 0; i < nkeys; i++) {
+		cb_tree_insert(&tree, keys[i]);
+	}
+
+	for (nthreads = 1; nthreads <= MAX_THREADS; nthreads *= 2) {
+		size_t found = 0;
+		double start = wall_time(), secs;
+
+		readers_done = 0;
+		pthread_create(&writer, NULL, writer_main, &tree);
+		for (i = 0; i < nthreads; i++) {
+			readers[i].tree = &tree;
+			readers[i].offset = i * (nkeys / nthreads);
+			readers[i].found = 0;
+			pthread_create(&readers[i].thread, NULL, reader_main, &readers[i]);
+		}
+		for (i = 0; i < nthreads; i++) {
+			pthread_join(readers[i].thread, NULL);
+			found += readers[i].found;
+		}
+		secs = wall_time() - start;
+		readers_done = 1;
+		pthread_join(writer, NULL);
+
+		/* No reader is left, so retired blocks can go */
+		for (i = 0; i < retired.n; i++) {
+			free(retired.blocks[i]);
+		}
+		printf("contains %4d-byte keys, %d readers: %8.1f Mops/s, %5.1f%% found, %d updates\n",
+			(int)len, (int)nthreads, nthreads * nkeys * LOOKUP_ROUNDS / secs * 1e-6,
+			100.0 * found / (nthreads * nkeys * LOOKUP_ROUNDS), (int)retired.n);
+		retired.n = 0;
+	}
+
+	cb_tree_clear(&tree);
+	free(retired.blocks);
+	free_keys();
+}
+
+static int count_cb(const char *key, void *baton)
+{
+	(*(int *)baton)++;
+	return 0;
+}
+
+struct writer {
+	pthread_t thread;
+	cb_tree_t *tree;
+	size_t begin, end;
+};
+
+static void *inserter_main(void *arg)
+{
+	struct writer *w = (struct writer *)arg;
+	size_t i;
+	for (i = w->begin; i < w->end; i++) {
+		cb_tree_insert(w->tree, keys[i]);
+	}
+	return NULL;
+}
+
+/* Insertions from 1 to 64 threads with compare-and-swap */
+static void bench_cas(size_t len)
+{
+	static struct writer writers[MAX_WRITERS];
+	cb_tree_t tree = cb_tree_make();
+	size_t i, nthreads;
+	double start;
+	int expected = 0, count;
+
+	make_keys(len);
+	start = wall_time();
+	for (i = 0; i < nkeys; i++) {
+		cb_tree_insert(&tree, keys[i]);
+	}
+	printf("insert   %4d-byte keys, serial    : %8.1f Mops/s\n", (int)len,
+		nkeys / (wall_time() - start) * 1e-6);
+	cb_tree_walk_prefixed(&tree, "", count_cb, &expected);
+	cb_tree_clear(&tree);
+
+	for (nthreads = 1; nthreads <= MAX_WRITERS; nthreads *= 2) {
+		cb_tree_use_concurrent_insert(&tree, 1);
+		start = wall_time();
+		for (i = 0; i < nthreads; i++) {
+			writers[i].tree = &tree;
+			writers[i].begin = i * nkeys / nthreads;
+			writers[i].end = (i + 1) * nkeys / nthreads;
+			pthread_create(&writers[i].thread, NULL, inserter_main, &writers[i]);
+		}
+		for (i = 0; i < nthreads; i++) {
+			pthread_join(writers[i].thread, NULL);
+		}
+		printf("insert   %4d-byte keys, %2d writers: %8.1f Mops/s\n", (int)len,
+			(int)nthreads, nkeys / (wall_time() - start) * 1e-6);
+
+		count = 0;
+		cb_tree_walk_prefixed(&tree, "", count_cb, &count);
+		if (count != expected) {
+			fprintf(stderr, "%d keys expected, but %d found\n", expected, count);
+			abort();
+		}
+		cb_tree_clear(&tree);
+	}
+	free_keys();
+}
+
+#define SNAPSHOTS 8
+#define SNAPSHOT_INTERVAL 100
+
+/* Memory and update cost of persistent trees, without snapshots and with
+a snapshot every SNAPSHOT_INTERVAL updates, of which the last SNAPSHOTS
+are kept */
+static void bench_persistent(size_t len)
+{
+	cb_tree_t snapshots[SNAPSHOTS];
+	size_t bytes = 0;
+	clock_t start;
+	size_t i, r;
+	int a;
+
+	make_keys(len);
+	for (a = 0; a < 3; a++) {
+		const char *name = a == 0 ? "plain" : a == 1 ? "persist" : "snaps";
+		cb_tree_t tree = cb_tree_make();
+		size_t nsnapshots = 0;
+
+		tree.malloc = counting_malloc;
+		tree.free = counting_free;
+		tree.baton = &bytes;
+		if (a > 0) {
+			cb_tree_use_persistent(&tree);
+		}
+		for (i = 0; i < nkeys; i++) {
+			cb_tree_insert(&tree, keys[i]);
+		}
+		printf("size     %4d-byte keys, %-7s: %8.1f bytes/key\n", (int)len, name,
+			(double)bytes / nkeys);
+
+		start = clock();
+		for (r = 0; r < nkeys; r++) {
+			size_t k = (size_t)rand() % nkeys;
+			if (a == 2 && r % SNAPSHOT_INTERVAL == 0) {
+				if (nsnapshots == SNAPSHOTS) {
+					cb_tree_clear(&snapshots[0]);
+					memmove(snapshots, snapshots + 1, (SNAPSHOTS - 1) * sizeof(cb_tree_t));
+					nsnapshots--;
+				}
+				snapshots[nsnapshots++] = cb_tree_snapshot(&tree);
+			}
+			cb_tree_delete(&tree, keys[k]);
+			cb_tree_insert(&tree, keys[k]);
+		}
+		printf("churn    %4d-byte keys, %-7s: %8.1f ns/op, %8.1f bytes/key\n", (int)len,
+			name, ns_per_op(start, nkeys * 2), (double)bytes / nkeys);
+
+		for (i = 0; i < nsnapshots; i++) {
+			cb_tree_clear(&snapshots[i]);
+		}
+		cb_tree_clear(&tree);
+	}
+	free_keys();
+}
+
+static void mutex_lock(void *lock)
+{
+	pthread_mutex_lock((pthread_mutex_t *)lock);
+}
+
+static void mutex_unlock(void *lock)
+{
+	pthread_mutex_unlock((pthread_mutex_t *)lock);
+}
+
+#define SHARDS 16
+
+struct shard_writer {
+	pthread_t thread;
+	cb_sharded_t *sharded;
+	size_t begin, end;
+};
+
+static void *shard_writer_main(void *arg)
+{
+	struct shard_writer *w = (struct shard_writer *)arg;
+	size_t i;
+	for (i = w->begin; i < w->end; i++) {
+		cb_sharded_insert(w->sharded, keys[i]);
+	}
+	return NULL;
+}
+
+/* Insertions from several threads, into a single locked tree (one shard)
+and into trees locked by shard */
+static void bench_sharded(size_t len)
+{
+	static pthread_mutex_t locks[SHARDS];
+	struct shard_writer writers[MAX_THREADS];
+	size_t i, nshards, nthreads;
+
+	make_keys(len);
+	for (i = 0; i < SHARDS; i++) {
+		pthread_mutex_init(&locks[i], NULL);
+	}
+
+	for (nshards = 1; nshards <= SHARDS; nshards *= SHARDS) {
+		for (nthreads = 1; nthreads <= MAX_THREADS; nthreads *= 2) {
+			cb_sharded_t sharded;
+			double start;
+			int count = 0;
+
+			cb_sharded_init(&sharded, nshards, 'a', 'z');
+			sharded.lock = mutex_lock;
+			sharded.unlock = mutex_unlock;
+			for (i = 0; i < nshards; i++) {
+				sharded.shards[i].lock = &locks[i];
+			}
+
+			start = wall_time();
+			for (i = 0; i < nthreads; i++) {
+				writers[i].sharded = &sharded;
+				writers[i].begin = i * nkeys / nthreads;
+				writers[i].end = (i + 1) * nkeys / nthreads;
+				pthread_create(&writers[i].thread, NULL, shard_writer_main, &writers[i]);
+			}
+			for (i = 0; i < nthreads; i++) {
+				pthread_join(writers[i].thread, NULL);
+			}
+			printf("insert   %4d-byte keys, %2d shards, %d writers: %8.1f Mops/s\n",
+				(int)len, (int)nshards, (int)nthreads,
+				nkeys / (wall_time() - start) * 1e-6);
+
+			cb_sharded_walk_prefixed(&sharded, "", count_cb, &count);
+			if (count == 0) {
+				fprintf(stderr, "No keys inserted\n");
+				abort();
+			}
+			cb_sharded_free(&sharded);
+		}
+	}
+
+	for (i = 0; i < SHARDS; i++) {
+		pthread_mutex_destroy(&locks[i]);
+	}
+	free_keys();
+}
+
+static const struct {
+	const char *name;
+	void (*run)(size_t len);
+	size_t len;
+} benchmarks[] = {
+	{ "contains", bench_contains, 6 },
+	{ "contains", bench_contains, 16 },
+	{ "contains", bench_contains, 200 },
+	{ "insert", bench_insert, 16 },
+	{ "insert", bench_insert, 200 },
+	{ "batch", bench_batch, 16 },
+	{ "prefix", bench_longest_prefix, 64 },
+	{ "build", bench_build, 32 },
+	{ "clear", bench_clear, 16 },
+	{ "churn", bench_churn, 32 },
+	{ "borrowed", bench_borrowed, 200 },
+	{ "compact", bench_compact, 16 },
+	{ "mt", bench_mt, 16 },
+	{ "cas", bench_cas, 16 },
+	{ "shard", bench_sharded, 12 },
+	{ "persist", bench_persistent, 16 }
+};
+
+#define benchmarks_size (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+/* Program entry point: bench [number of keys [benchmark name]] */
+int main(int argc, char **argv)
+{
+	size_t i;
+
+	if (argc > 1) {
+		nkeys = (size_t)atol(argv[1]);
+	}
+
+	for (i = 0; i < benchmarks_size; i++) {
+		if (argc > 2 && strcmp(argv[2], benchmarks[i].name) != 0) {
+			continue;
+		}
+		srand(1);
+		benchmarks[i].run(benchmarks[i].len);
+	}
+
+	return 0;
+}
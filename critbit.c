@@ -12,9 +12,6 @@
 
 #include "critbit.h"
 
-#define TYPE_LEAF 1
-#define TYPE_NODE 2
-
 /*
 Prefix nodes have:
 - the prefix as the left child;
@@ -42,18 +39,324 @@ typedef unsigned char cb_byte_t;
   typedef unsigned long cb_keylen_t;
 #endif
 
-typedef struct {
-	struct cb_node_t *node;
-	cb_byte_t *leaf;
-} cb_child_t;
-
 typedef struct cb_node_t {
-	cb_child_t child[2];
+	void *child[2];
 	cb_keylen_t byte;
-	cb_byte_t type[2];
 	cb_byte_t otherbits;
 } cb_node_t;
 
+/*
+Each key is allocated in a single buffer together with a node:
+- the node itself;
+- the leaf, i.e. the key length;
+- the key bytes, followed by a terminating zero byte;
+- an optional value slot, suitably aligned.
+Borrowed keys are not copied: their leaf stores the caller's pointer in
+place of the key bytes, and has the BORROWED flag set in its length.
+*/
+typedef struct {
+	cb_keylen_t len;
+} cb_leaf_t;
+
+typedef struct {
+	cb_leaf_t leaf;
+	const cb_byte_t *key;
+} cb_borrowed_leaf_t;
+
+#define BORROWED ((cb_keylen_t)1 << (sizeof(cb_keylen_t) * CHAR_BIT - 1))
+#define MAX_KEYLEN (BORROWED - 1)
+
+/* Value slots are aligned like the most demanding of these types */
+typedef union {
+	long l;
+	double d;
+	long double ld;
+	void *p;
+} cb_align_t;
+
+#define ALIGN_UP(n) \
+	(((n) + sizeof(cb_align_t) - 1) / sizeof(cb_align_t) * sizeof(cb_align_t))
+
+#define KEY_OFFSET (sizeof(cb_node_t) + sizeof(cb_leaf_t))
+
+static cb_keylen_t cb_get_keylen(const cb_leaf_t *leaf)
+{
+	return leaf->len & MAX_KEYLEN;
+}
+
+static const cb_byte_t *cb_get_key(const cb_leaf_t *leaf)
+{
+	if (leaf->len & BORROWED) {
+		return ((const cb_borrowed_leaf_t *)leaf)->key;
+	}
+	return (const cb_byte_t *)(leaf + 1);
+}
+
+static size_t cb_get_value_offset(cb_keylen_t len)
+{
+	if (len & BORROWED) {
+		return ALIGN_UP(sizeof(cb_node_t) + sizeof(cb_borrowed_leaf_t));
+	}
+	return ALIGN_UP(KEY_OFFSET + len + 1);
+}
+
+static void *cb_get_value(const cb_leaf_t *leaf)
+{
+	return (char *)leaf - sizeof(cb_node_t) + cb_get_value_offset(leaf->len);
+}
+
+/*
+Children carry their type in the lowest pointer bits, as in the original
+implementation: pointers to internal nodes have the lowest bit set, while
+pointers to leaves (which always follow a node in an aligned buffer) are
+stored unmodified.
+Keys of up to MAX_INLINE bytes can also be stored in the child itself, as
+a word holding INLINE_TAG in the two lowest bits, the key length in the
+next six bits and the key bytes above, so that a lookup ending at such a
+key does not need to load its leaf. Only the child of the node allocated
+together with the key may be inlined, so the leaf can still be found
+right after that node; children are turned back into leaf pointers
+whenever they are moved to a different node.
+*/
+#define IS_NODE(child) (((size_t)(child) & 1) != 0)
+#define NODE(child) ((cb_node_t *)((char *)(child) - 1))
+#define LEAF(child) ((cb_leaf_t *)(child))
+#define TAG_NODE(node) ((void *)((char *)(node) + 1))
+
+#define INLINE_TAG 2
+#define IS_INLINE(child) (((size_t)(child) & 3) == INLINE_TAG)
+#define MAX_INLINE (sizeof(size_t) - 1)
+
+/*
+Trees with subtree counts allocate a word before each node, holding the
+number of keys below it. The count of the root is the size of the tree.
+*/
+#define COUNT_SIZE ALIGN_UP(sizeof(size_t))
+#define COUNT(node) (*cb_count(node))
+
+static size_t *cb_count(cb_node_t *node)
+{
+	return (size_t *)node - 1;
+}
+
+static size_t cb_child_count(void *child)
+{
+	return IS_NODE(child) ? COUNT(NODE(child)) : 1;
+}
+
+/*
+Persistent trees allocate two words before each node instead: the number
+of references to the block, from parent nodes or tree versions to its
+node or its leaf, and the number of references to the node alone. A node
+referenced once belongs to a single version and can be modified in place;
+nodes shared between versions are copied into blocks of their own first.
+*/
+#define REFS_SIZE ALIGN_UP(2 * sizeof(size_t))
+#define BLOCK_REFS(node) (cb_refs(node)[0])
+#define NODE_REFS(node) (cb_refs(node)[1])
+
+static size_t *cb_refs(cb_node_t *node)
+{
+	return (size_t *)node - 2;
+}
+
+/* Returns the start of the block allocated for node */
+static void *cb_node_block(const cb_tree_t *tree, cb_node_t *node)
+{
+	if (tree->persistent) {
+		return (char *)node - REFS_SIZE;
+	}
+	return tree->counted ? (char *)node - COUNT_SIZE : (char *)node;
+}
+
+static size_t cb_pack_key(const cb_byte_t *key, cb_keylen_t len)
+{
+	size_t word = ((size_t)len << 2) | INLINE_TAG;
+	cb_keylen_t i;
+	for (i = 0; i < len; i++) {
+		word |= (size_t)key[i] << (8 * (i + 1));
+	}
+	return word;
+}
+
+/* Returns the child to store for the leaf following node in its buffer */
+static void *cb_leaf_child(cb_node_t *node)
+{
+	cb_leaf_t *leaf = (cb_leaf_t *)(node + 1);
+	cb_keylen_t len = cb_get_keylen(leaf);
+	if (len <= MAX_INLINE) {
+		return (void *)cb_pack_key(cb_get_key(leaf), len);
+	}
+	return leaf;
+}
+
+/* Returns the leaf of a child which is not a node */
+static cb_leaf_t *cb_child_leaf(cb_node_t *par, int dir)
+{
+	if (IS_INLINE(par->child[dir])) {
+		return (cb_leaf_t *)(par + 1);
+	}
+	return LEAF(par->child[dir]);
+}
+
+/* Returns a child of par suitable for storing in a different node */
+static void *cb_move_child(cb_node_t *par, int dir)
+{
+	if (IS_INLINE(par->child[dir])) {
+		return (cb_leaf_t *)(par + 1);
+	}
+	return par->child[dir];
+}
+
+/* Returns non-zero if child, which is not a node, holds the given key */
+static int cb_value_matches(const void *child,
+	const cb_byte_t *ubytes, cb_keylen_t ulen)
+{
+	const cb_leaf_t *leaf;
+	if (IS_INLINE(child)) {
+		return ulen <= MAX_INLINE && (size_t)child == cb_pack_key(ubytes, ulen);
+	}
+	leaf = LEAF(child);
+	return ulen == cb_get_keylen(leaf) &&
+		memcmp(ubytes, cb_get_key(leaf), ulen) == 0;
+}
+
+/* Returns non-zero if the child of par, which is not a node, holds the
+given key */
+static int cb_child_matches(cb_node_t *par, int dir,
+	const cb_byte_t *ubytes, cb_keylen_t ulen)
+{
+	return cb_value_matches(par->child[dir], ubytes, ulen);
+}
+
+/*
+Trees in RCU mode are read concurrently with a single writer. The writer
+publishes every change to the tree with a release store of a single child
+pointer (or the root), and readers load child pointers with acquire
+semantics, so they always see initialized nodes. The only change made in
+place is the relocation of a node on deletion, which is bracketed by a
+sequence count: readers may take a wrong turn while it happens, which
+can only make them miss a key, so they retry failed lookups if the count
+changed. Deleted blocks are retired instead of freed, and released once
+no reader can hold them any more.
+Without GCC-style atomic builtins, the accesses are plain and RCU mode is
+not safe.
+*/
+#ifdef __GNUC__
+#define LOAD_ACQUIRE(x) __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define LOAD_RELAXED(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define STORE_RELEASE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+#define STORE_RELAXED(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#define FENCE_ACQUIRE() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define FENCE_RELEASE() __atomic_thread_fence(__ATOMIC_RELEASE)
+#define FENCE_FULL() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define CAS(x, old, v) __atomic_compare_exchange_n(&(x), &(old), (v), 0, \
+	__ATOMIC_RELEASE, __ATOMIC_RELAXED)
+#define REF_INC(x) __atomic_add_fetch(&(x), 1, __ATOMIC_RELAXED)
+#define REF_DEC(x) __atomic_sub_fetch(&(x), 1, __ATOMIC_ACQ_REL)
+#else
+#define LOAD_ACQUIRE(x) (x)
+#define LOAD_RELAXED(x) (x)
+#define STORE_RELEASE(x, v) ((x) = (v))
+#define STORE_RELAXED(x, v) ((x) = (v))
+#define FENCE_ACQUIRE() ((void)0)
+#define FENCE_RELEASE() ((void)0)
+#define FENCE_FULL() ((void)0)
+#define CAS(x, old, v) ((void)(old), (x) = (v), 1)
+#define REF_INC(x) (++(x))
+#define REF_DEC(x) (--(x))
+#endif
+
+static void cb_write_begin(cb_tree_t *tree)
+{
+	if (tree->retire != NULL) {
+		STORE_RELAXED(tree->seq, tree->seq + 1);
+		FENCE_RELEASE();
+	}
+}
+
+static void cb_write_end(cb_tree_t *tree)
+{
+	if (tree->retire != NULL) {
+		STORE_RELEASE(tree->seq, tree->seq + 1);
+	}
+}
+
+/* Adds a reference to child */
+static void cb_persist_ref(void *child)
+{
+	cb_node_t *node;
+	if (IS_NODE(child)) {
+		node = NODE(child);
+		REF_INC(NODE_REFS(node));
+	}
+	else {
+		node = (cb_node_t *)LEAF(child) - 1;
+	}
+	REF_INC(BLOCK_REFS(node));
+}
+
+/* Drops a reference to child, freeing what is no longer referenced */
+static void cb_persist_release(cb_tree_t *tree, void *child)
+{
+	cb_node_t *node;
+	if (IS_NODE(child)) {
+		node = NODE(child);
+		if (REF_DEC(NODE_REFS(node)) == 0) {
+			/* the root has a single child */
+			if (node->child[0] != NULL) {
+				cb_persist_release(tree, node->child[0]);
+			}
+			cb_persist_release(tree, node->child[1]);
+		}
+	}
+	else {
+		node = (cb_node_t *)LEAF(child) - 1;
+	}
+	if (REF_DEC(BLOCK_REFS(node)) == 0) {
+		tree->free(cb_node_block(tree, node), tree->baton);
+	}
+}
+
+/* Makes the node in slot belong to tree alone, copying it if it is shared
+with other versions. Returns the node, or NULL if the copy failed. */
+static cb_node_t *cb_persist_own(cb_tree_t *tree, void **slot)
+{
+	cb_node_t *node = NODE(*slot);
+	cb_node_t *copy;
+	char *buffer;
+
+	if (LOAD_ACQUIRE(NODE_REFS(node)) == 1) {
+		return node;
+	}
+	buffer = (char *)tree->malloc(REFS_SIZE + sizeof(cb_node_t), tree->baton);
+	if (buffer == NULL) {
+		return NULL;
+	}
+	copy = (cb_node_t *)(buffer + REFS_SIZE);
+	*copy = *node;
+	BLOCK_REFS(copy) = 1;
+	NODE_REFS(copy) = 1;
+	if (copy->child[0] != NULL) {
+		cb_persist_ref(copy->child[0]);
+	}
+	cb_persist_ref(copy->child[1]);
+	cb_persist_release(tree, *slot);
+	*slot = TAG_NODE(copy);
+	return copy;
+}
+
+/* Makes the root belong to tree alone, like cb_persist_own() */
+static cb_node_t *cb_persist_own_root(cb_tree_t *tree)
+{
+	void *root = TAG_NODE(tree->root);
+	cb_node_t *node = cb_persist_own(tree, &root);
+	if (node != NULL) {
+		tree->root = node;
+	}
+	return node;
+}
+
 /* Standard memory allocation functions */
 static void *malloc_std(size_t size, void *baton) {
 	(void)baton; /* Prevent compiler warnings */
@@ -65,22 +368,433 @@ static void free_std(void *ptr, void *baton) {
 	free(ptr);
 }
 
+/*
+Arena memory allocation functions.
+Blocks are carved sequentially out of large chunks, which are kept in a
+singly linked list. Blocks larger than a quarter of the chunk size get a
+chunk of their own, so that the current chunk is not abandoned early.
+Single blocks are never released: all chunks are freed at once.
+*/
+#define ARENA_CHUNK_SIZE (1 << 16)
+
+typedef union cb_chunk_t {
+	union cb_chunk_t *next;
+	cb_align_t align;
+} cb_chunk_t;
+
+static void *arena_chunk(cb_arena_t *arena, size_t size)
+{
+	cb_chunk_t *chunk = (cb_chunk_t*)malloc(sizeof(cb_chunk_t) + size);
+	if (chunk == NULL) {
+		return NULL;
+	}
+	chunk->next = (cb_chunk_t*)arena->chunks;
+	arena->chunks = chunk;
+	return chunk + 1;
+}
+
+static void *malloc_arena(size_t size, void *baton)
+{
+	cb_arena_t *arena = (cb_arena_t *)baton;
+	char *block;
+
+	size = ALIGN_UP(size);
+	if (size > arena->left) {
+		if (size > arena->chunk_size / 4) {
+			return arena_chunk(arena, size);
+		}
+		block = (char*)arena_chunk(arena, arena->chunk_size);
+		if (block == NULL) {
+			return NULL;
+		}
+		arena->next = block;
+		arena->left = arena->chunk_size;
+	}
+
+	block = arena->next;
+	arena->next += size;
+	arena->left -= size;
+	return block;
+}
+
+static void free_arena(void *ptr, void *baton) {
+	(void)ptr; /* Prevent compiler warnings */
+	(void)baton;
+}
+
+static void clear_arena(void *baton) {
+	cb_arena_clear((cb_arena_t *)baton);
+}
+
+/*
+Pool memory allocation functions.
+These allocate from the arena as well, but each block is preceded by a
+header recording its rounded size, so freed blocks can be kept on
+per-size free lists and handed out again. Blocks larger than the last
+size class share a single free list and are reused on a first fit basis.
+*/
+#define POOL_GRAIN (2 * sizeof(cb_align_t))
+#define POOL_MAX (CB_POOL_CLASSES * POOL_GRAIN)
+
+typedef union {
+	size_t size;
+	cb_align_t align;
+} cb_pool_header_t;
+
+static void *malloc_pool(size_t size, void *baton)
+{
+	cb_arena_t *arena = (cb_arena_t *)baton;
+	cb_pool_header_t *header;
+	void **list;
+
+	size = (size + POOL_GRAIN - 1) / POOL_GRAIN * POOL_GRAIN;
+	if (size == 0) {
+		size = POOL_GRAIN;
+	}
+
+	if (size <= POOL_MAX) {
+		list = &arena->free_lists[size / POOL_GRAIN - 1];
+	}
+	else {
+		list = &arena->large;
+		while (*list != NULL && ((cb_pool_header_t *)*list - 1)->size < size) {
+			list = (void **)*list;
+		}
+	}
+	if (*list != NULL) {
+		void *block = *list;
+		*list = *(void **)block;
+		arena->hits++;
+		return block;
+	}
+
+	header = (cb_pool_header_t *)malloc_arena(sizeof(cb_pool_header_t) + size, arena);
+	if (header == NULL) {
+		return NULL;
+	}
+	header->size = size;
+	arena->misses++;
+	return header + 1;
+}
+
+static void free_pool(void *ptr, void *baton) {
+	cb_arena_t *arena = (cb_arena_t *)baton;
+	size_t size = ((cb_pool_header_t *)ptr - 1)->size;
+	void **list;
+
+	if (size <= POOL_MAX) {
+		list = &arena->free_lists[size / POOL_GRAIN - 1];
+	}
+	else {
+		list = &arena->large;
+	}
+	*(void **)ptr = *list;
+	*list = ptr;
+}
+
+/*! Creates a new, empty arena */
+cb_arena_t cb_arena_make(size_t chunk_size)
+{
+	cb_arena_t arena;
+	int i;
+	arena.chunks = NULL;
+	arena.next = NULL;
+	arena.left = 0;
+	arena.chunk_size = ALIGN_UP(chunk_size ? chunk_size : ARENA_CHUNK_SIZE);
+	for (i = 0; i < CB_POOL_CLASSES; i++) {
+		arena.free_lists[i] = NULL;
+	}
+	arena.large = NULL;
+	arena.hits = 0;
+	arena.misses = 0;
+	return arena;
+}
+
+/*! Frees all memory allocated from the arena */
+void cb_arena_clear(cb_arena_t *arena)
+{
+	cb_chunk_t *chunk = (cb_chunk_t*)arena->chunks;
+	int i;
+	while (chunk != NULL) {
+		cb_chunk_t *next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+	arena->chunks = NULL;
+	arena->next = NULL;
+	arena->left = 0;
+	for (i = 0; i < CB_POOL_CLASSES; i++) {
+		arena->free_lists[i] = NULL;
+	}
+	arena->large = NULL;
+}
+
+/*! Makes the given empty tree allocate its memory from arena */
+void cb_tree_use_arena(cb_tree_t *tree, cb_arena_t *arena)
+{
+	tree->malloc = &malloc_arena;
+	tree->free = &free_arena;
+	tree->clear = &clear_arena;
+	tree->baton = arena;
+}
+
+/*! Makes tree safe for concurrent lookups, retiring deleted blocks */
+int cb_tree_use_rcu(cb_tree_t *tree, void (*retire)(void *ptr, void *baton))
+{
+	if (tree->persistent) {
+		return EINVAL;
+	}
+	tree->retire = retire;
+	return 0;
+}
+
+/*
+Epoch-based reclamation: readers publish the global epoch they entered
+in, and the writer only advances the epoch once every active reader has
+seen the current one. A block retired in epoch e was unlinked before the
+epoch became e + 1, and every reader active in epoch e + 2 entered after
+that, so the block is freed once the epoch reaches e + 2.
+*/
+typedef struct cb_retired_t {
+	void *ptr;
+	unsigned long epoch;
+} cb_retired_t;
+
+#define EPOCH_THRESHOLD 64
+
+/* Allocator hooks forwarding to those the tree had before */
+static void *malloc_epoch(size_t size, void *baton)
+{
+	cb_epoch_t *epoch = (cb_epoch_t *)baton;
+	return epoch->malloc(size, epoch->baton);
+}
+
+static void free_epoch(void *ptr, void *baton)
+{
+	cb_epoch_t *epoch = (cb_epoch_t *)baton;
+	epoch->free(ptr, epoch->baton);
+}
+
+static void clear_epoch(void *baton)
+{
+	cb_epoch_t *epoch = (cb_epoch_t *)baton;
+	epoch->clear(epoch->baton);
+	/* the retired blocks and their list are gone as well */
+	epoch->retired = NULL;
+	epoch->size = 0;
+	epoch->capacity = 0;
+}
+
+/* Advances the epoch if all active readers have seen the current one */
+static void cb_epoch_advance(cb_epoch_t *epoch)
+{
+	unsigned long current = epoch->epoch;
+	cb_epoch_reader_t *reader;
+
+	FENCE_FULL();
+	for (reader = LOAD_ACQUIRE(epoch->readers); reader != NULL; reader = reader->next) {
+		unsigned long seen = LOAD_RELAXED(reader->epoch);
+		if (seen != 0 && seen != current) {
+			return;
+		}
+	}
+	FENCE_FULL();
+	STORE_RELAXED(epoch->epoch, current + 1);
+}
+
+/* Frees the retired blocks no reader can hold any more */
+static void cb_epoch_free_retired(cb_epoch_t *epoch)
+{
+	size_t i;
+	for (i = 0; i < epoch->size && epoch->epoch - epoch->retired[i].epoch >= 2; i++) {
+		epoch->free(epoch->retired[i].ptr, epoch->baton);
+	}
+	memmove(epoch->retired, epoch->retired + i,
+		(epoch->size - i) * sizeof(cb_retired_t));
+	epoch->size -= i;
+}
+
+static void retire_epoch(void *ptr, void *baton)
+{
+	cb_epoch_t *epoch = (cb_epoch_t *)baton;
+
+	if (epoch->size == epoch->capacity) {
+		size_t capacity = epoch->capacity ? 2 * epoch->capacity : EPOCH_THRESHOLD;
+		cb_retired_t *retired = (cb_retired_t *)epoch->malloc(
+			capacity * sizeof(cb_retired_t), epoch->baton);
+		if (retired == NULL) {
+			/* wait for the readers instead of keeping track of ptr */
+			cb_epoch_synchronize(epoch);
+			epoch->free(ptr, epoch->baton);
+			return;
+		}
+		if (epoch->retired != NULL) {
+			memcpy(retired, epoch->retired, epoch->size * sizeof(cb_retired_t));
+			epoch->free(epoch->retired, epoch->baton);
+		}
+		epoch->retired = retired;
+		epoch->capacity = capacity;
+	}
+
+	epoch->retired[epoch->size].ptr = ptr;
+	epoch->retired[epoch->size].epoch = epoch->epoch;
+	epoch->size++;
+	if (++epoch->pending >= EPOCH_THRESHOLD) {
+		cb_epoch_reclaim(epoch);
+	}
+}
+
+/*! Creates a new epoch manager without readers */
+cb_epoch_t cb_epoch_make()
+{
+	cb_epoch_t epoch;
+	epoch.epoch = 1;
+	epoch.readers = NULL;
+	epoch.retired = NULL;
+	epoch.size = 0;
+	epoch.capacity = 0;
+	epoch.pending = 0;
+	epoch.malloc = NULL;
+	epoch.free = NULL;
+	epoch.clear = NULL;
+	epoch.baton = NULL;
+	return epoch;
+}
+
+/*! Puts tree in RCU mode, with deleted blocks reclaimed by epoch */
+int cb_tree_use_epoch(cb_tree_t *tree, cb_epoch_t *epoch)
+{
+	if (tree->persistent) {
+		return EINVAL;
+	}
+	epoch->malloc = tree->malloc;
+	epoch->free = tree->free;
+	epoch->clear = tree->clear;
+	epoch->baton = tree->baton;
+	tree->malloc = &malloc_epoch;
+	tree->free = &free_epoch;
+	tree->clear = tree->clear != NULL ? &clear_epoch : NULL;
+	tree->baton = epoch;
+	return cb_tree_use_rcu(tree, &retire_epoch);
+}
+
+/*! Adds reader to the readers of epoch */
+void cb_epoch_register(cb_epoch_t *epoch, cb_epoch_reader_t *reader)
+{
+	cb_epoch_reader_t *head = LOAD_RELAXED(epoch->readers);
+	reader->epoch = 0;
+	do {
+		reader->next = head;
+	} while (!CAS(epoch->readers, head, reader));
+}
+
+/*! Starts a read-side section */
+void cb_epoch_enter(cb_epoch_t *epoch, cb_epoch_reader_t *reader)
+{
+	STORE_RELAXED(reader->epoch, LOAD_RELAXED(epoch->epoch));
+	FENCE_FULL();
+}
+
+/*! Ends a read-side section */
+void cb_epoch_exit(cb_epoch_reader_t *reader)
+{
+	STORE_RELEASE(reader->epoch, 0);
+}
+
+/*! Frees the retired blocks that readers cannot reach any more */
+void cb_epoch_reclaim(cb_epoch_t *epoch)
+{
+	epoch->pending = 0;
+	cb_epoch_advance(epoch);
+	cb_epoch_free_retired(epoch);
+}
+
+/*! Waits for the active readers, then frees all retired blocks */
+void cb_epoch_synchronize(cb_epoch_t *epoch)
+{
+	unsigned long target = epoch->epoch + 2;
+	while (epoch->epoch != target) {
+		cb_epoch_advance(epoch);
+	}
+	cb_epoch_free_retired(epoch);
+	if (epoch->retired != NULL) {
+		epoch->free(epoch->retired, epoch->baton);
+	}
+	epoch->retired = NULL;
+	epoch->capacity = 0;
+	epoch->pending = 0;
+}
+
+/*! Lets threads insert keys into tree concurrently, or stops doing so */
+int cb_tree_use_concurrent_insert(cb_tree_t *tree, int on)
+{
+	if (on && (tree->counted || tree->persistent)) {
+		return EINVAL;
+	}
+	tree->concurrent = on != 0;
+	return 0;
+}
+
+/*! Makes the given empty tree keep versions, see cb_tree_snapshot() */
+int cb_tree_use_persistent(cb_tree_t *tree)
+{
+	if (tree->root != NULL || tree->counted || tree->concurrent ||
+			tree->retire != NULL) {
+		return EINVAL;
+	}
+	tree->persistent = 1;
+	return 0;
+}
+
+/*! Returns a new version of tree sharing all its nodes, in constant time */
+cb_tree_t cb_tree_snapshot(cb_tree_t *tree)
+{
+	/* Other trees have no reference counts in front of their nodes */
+	if (!tree->persistent) {
+		return cb_tree_make();
+	}
+	if (tree->root != NULL) {
+		cb_persist_ref(TAG_NODE(tree->root));
+	}
+	return *tree;
+}
+
+/*! Makes the given empty tree keep subtree counts */
+int cb_tree_use_counts(cb_tree_t *tree)
+{
+	if (tree->root != NULL || tree->persistent || tree->concurrent) {
+		return EINVAL;
+	}
+	tree->counted = 1;
+	return 0;
+}
+
+/*! Makes the given empty tree allocate its memory from arena, reusing
+deleted blocks */
+void cb_tree_use_pool(cb_tree_t *tree, cb_arena_t *arena)
+{
+	tree->malloc = &malloc_pool;
+	tree->free = &free_pool;
+	tree->clear = &clear_arena;
+	tree->baton = arena;
+}
+
 /* Static helper functions */
 static void cbt_traverse_delete(cb_tree_t *tree, cb_node_t *par, int dir)
 {
-	if (par->type[dir] == TYPE_NODE) {
-		cb_node_t *q = par->child[dir].node;
+	if (IS_NODE(par->child[dir])) {
+		cb_node_t *q = NODE(par->child[dir]);
 		cbt_traverse_delete(tree, q, 0);
 		cbt_traverse_delete(tree, q, 1);
-		tree->free((char*)q, tree->baton);
+		tree->free(cb_node_block(tree, q), tree->baton);
 	}
 }
 
 static int cbt_traverse_prefixed(cb_node_t * par, int dir,
-	int (*callback)(const cb_byte_t*, void *), void *baton)
+	int (*callback)(const void *, size_t, void *), void *baton)
 {
-	if (par->type[dir] == TYPE_NODE) {
-		cb_node_t *q = par->child[dir].node;
+	if (IS_NODE(par->child[dir])) {
+		cb_node_t *q = NODE(par->child[dir]);
 		int ret = 0;
 
 		ret = cbt_traverse_prefixed(q, 0, callback, baton);
@@ -94,7 +808,8 @@ static int cbt_traverse_prefixed(cb_node_t * par, int dir,
 		return 0;
 	}
 
-	return (callback)(par->child[dir].leaf, baton);
+	return (callback)(cb_get_key(cb_child_leaf(par, dir)),
+		cb_get_keylen(cb_child_leaf(par, dir)), baton);
 }
 
 static int numbit(cb_byte_t mask)
@@ -117,8 +832,8 @@ static int numbit(cb_byte_t mask)
 static void cbt_traverse_print(cb_tree_t *tree, cb_node_t *par, int dir, char* prefix)
 {
 	size_t lprefix = strlen(prefix);
-	if (par->type[dir] == TYPE_NODE) {
-		cb_node_t *q = par->child[dir].node;
+	if (IS_NODE(par->child[dir])) {
+		cb_node_t *q = NODE(par->child[dir]);
 		printf("%s+-- %d N off=%d bit=%d\n", prefix, dir, (int)q->byte, numbit(q->otherbits));
 		if (lprefix < MAX_PREFIX - 5)
 			sprintf(prefix + lprefix, "%c   ", (dir || (!*prefix)) ? ' ' : '|');
@@ -127,8 +842,9 @@ static void cbt_traverse_print(cb_tree_t *tree, cb_node_t *par, int dir, char* p
 		prefix[lprefix] = 0;
 	}
 	else {
-		const char * leaf = (const char*)par->child[dir].leaf;
-		printf("%s+-- %d L \"%s\"\n", prefix, dir, leaf ? leaf : "(nil)");
+		const cb_leaf_t * leaf = cb_child_leaf(par, dir);
+		printf("%s+-- %d L \"%s\"\n", prefix, dir,
+			leaf ? (const char*)cb_get_key(leaf) : "(nil)");
 	}
 }
 
@@ -150,34 +866,70 @@ cb_tree_t cb_tree_make()
 {
 	cb_tree_t tree;
 	tree.root = NULL;
+	tree.counted = 0;
+	tree.concurrent = 0;
+	tree.persistent = 0;
+	tree.seq = 0;
 	tree.malloc = &malloc_std;
 	tree.free = &free_std;
+	tree.clear = NULL;
+	tree.retire = NULL;
 	tree.baton = NULL;
 	return tree;
 }
 
 
-static cb_keylen_t cb_get_keylen(const cb_byte_t * key)
+/* Lookup for trees in RCU mode, see cb_write_begin() */
+static const cb_leaf_t *cb_tree_find_rcu(cb_tree_t *tree,
+	const cb_byte_t *ubytes, cb_keylen_t ulen)
 {
-	return strlen((const char*)key);
-}
+	for (;;) {
+		unsigned long seq = LOAD_ACQUIRE(tree->seq);
+		cb_node_t *p = LOAD_ACQUIRE(tree->root);
+
+		if (p != NULL && (seq & 1) == 0) {
+			void *child = LOAD_ACQUIRE(p->child[ROOT_DIRECTION]);
+			while (IS_NODE(child)) {
+				int direction = 0;
+				p = NODE(child);
+				if (p->byte < ulen) {
+					cb_byte_t c = ubytes[p->byte];
+					direction = (1 + (p->otherbits | c)) >> 8;
+				}
+				child = LOAD_ACQUIRE(p->child[direction]);
+			}
 
-static int cb_tree_contains_i(cb_tree_t *tree, const cb_byte_t *ubytes, cb_keylen_t ulen)
-{
-	cb_node_t *p;
-	int direction;
-	const cb_byte_t *leaf;
-	cb_keylen_t llen;
+			/* A relocated root can leave a null child behind */
+			if (child != NULL && cb_value_matches(child, ubytes, ulen)) {
+				return IS_INLINE(child) ? (cb_leaf_t *)(p + 1) : LEAF(child);
+			}
+		}
+
+		FENCE_ACQUIRE();
+		if ((seq & 1) == 0 && LOAD_RELAXED(tree->seq) == seq) {
+			return NULL;
+		}
+	}
+}
+
+static const cb_leaf_t *cb_tree_find_i(cb_tree_t *tree,
+	const cb_byte_t *ubytes, cb_keylen_t ulen)
+{
+	cb_node_t *p;
+	int direction;
 
+	if (tree->retire != NULL || tree->concurrent) {
+		return cb_tree_find_rcu(tree, ubytes, ulen);
+	}
 	if (tree->root == NULL) {
-		return 0;
+		return NULL;
 	}
 
 	p = tree->root;
 	direction = ROOT_DIRECTION;
 
-	while (p->type[direction] == TYPE_NODE) {
-		p = p->child[direction].node;
+	while (IS_NODE(p->child[direction])) {
+		p = NODE(p->child[direction]);
 		direction = 0;
 		if (p->byte < ulen) {
 			cb_byte_t c = ubytes[p->byte];
@@ -185,53 +937,166 @@ static int cb_tree_contains_i(cb_tree_t *tree, const cb_byte_t *ubytes, cb_keyle
 		}
 	}
 
-	leaf = p->child[direction].leaf;
-	llen = cb_get_keylen(leaf);
-	return (ulen == llen) && (memcmp(ubytes, leaf, ulen) == 0);
+	if (!cb_child_matches(p, direction, ubytes, ulen)) {
+		return NULL;
+	}
+	return cb_child_leaf(p, direction);
 }
 
 /*! Returns non-zero if tree contains str */
 int cb_tree_contains(cb_tree_t *tree, const char *str)
 {
-	return cb_tree_contains_i (tree, (const cb_byte_t *)str, strlen(str));
+	return cb_tree_find_i (tree, (const cb_byte_t *)str, strlen(str)) != NULL;
 }
 
-static int cb_tree_insert_node(cb_tree_t *tree, cb_node_t *newnode, cb_byte_t *ubytes)
+/*! Returns non-zero if tree contains the len bytes at key */
+int cb_tree_contains_n(cb_tree_t *tree, const void *key, size_t len)
 {
-	const cb_keylen_t ulen = cb_get_keylen(ubytes);
-	cb_node_t *p;
-	cb_byte_t c;
-	const cb_byte_t *leaf;
-	cb_keylen_t llen, clen;
-	cb_keylen_t newbyte;
-	cb_keylen_t newotherbits;
-	int direction, newdirection;
+	if (len > MAX_KEYLEN) {
+		return 0;
+	}
+	return cb_tree_find_i (tree, (const cb_byte_t *)key, len) != NULL;
+}
+
+/*
+Batched lookups keep BATCH_WIDTH searches in flight. Each round advances
+every search by one level and prefetches the child it will look at in the
+next round, so the cache misses of different searches overlap instead of
+stalling one after another. Finished searches are replaced by new ones.
+*/
+#define BATCH_WIDTH 16
+
+#ifdef __GNUC__
+#define PREFETCH(addr) __builtin_prefetch(addr)
+#else
+#define PREFETCH(addr) ((void)0)
+#endif
+
+static void cb_prefetch_child(const void *child)
+{
+	if (IS_NODE(child)) {
+		PREFETCH(NODE(child));
+	}
+	else if (!IS_INLINE(child)) {
+		PREFETCH(child);
+	}
+}
+
+/*! Looks up n keys at once, setting results[i] to non-zero if the tree
+contains the lens[i] bytes at keys[i] */
+size_t cb_tree_contains_batch(cb_tree_t *tree, const void *const *keys,
+	const size_t *lens, size_t n, int *results)
+{
+	struct {
+		cb_node_t *p;
+		int direction;
+		const cb_byte_t *ubytes;
+		size_t ulen; /* not narrowed, so that longer keys are not found */
+		size_t k;
+	} slot[BATCH_WIDTH];
+	size_t active = 0, next = 0, found = 0, i;
 
 	if (tree->root == NULL) {
-		memset (newnode, 0, sizeof (*newnode));
-		newnode->child[ROOT_DIRECTION].leaf = ubytes;
-		newnode->type[ROOT_DIRECTION] = TYPE_LEAF;
-		tree->root = newnode;
+		for (i = 0; i < n; i++) {
+			results[i] = 0;
+		}
 		return 0;
 	}
 
-	p = tree->root;
-	direction = ROOT_DIRECTION;
+	cb_prefetch_child(tree->root->child[ROOT_DIRECTION]);
+	while (active < BATCH_WIDTH && next < n) {
+		slot[active].k = next++;
+		slot[active].p = NULL;
+		active++;
+	}
 
-	while (p->type[direction] == TYPE_NODE) {
-		p = p->child[direction].node;
-		direction = 0;
-		if (p->byte < ulen) {
-			c = ubytes[p->byte];
-			direction = (1 + (p->otherbits | c)) >> 8;
+	i = 0;
+	while (active > 0) {
+		cb_node_t *p;
+		void *child;
+
+		if (slot[i].p == NULL) {
+			size_t k = slot[i].k;
+			slot[i].p = tree->root;
+			slot[i].direction = ROOT_DIRECTION;
+			slot[i].ubytes = (const cb_byte_t *)keys[k];
+			slot[i].ulen = lens ? lens[k] : strlen((const char *)keys[k]);
+		}
+
+		p = slot[i].p;
+		child = p->child[slot[i].direction];
+		if (IS_NODE(child)) {
+			int direction = 0;
+			p = NODE(child);
+			if (p->byte < slot[i].ulen) {
+				cb_byte_t c = slot[i].ubytes[p->byte];
+				direction = (1 + (p->otherbits | c)) >> 8;
+			}
+			slot[i].p = p;
+			slot[i].direction = direction;
+			cb_prefetch_child(p->child[direction]);
+		}
+		else {
+			int match = slot[i].ulen <= MAX_KEYLEN && cb_child_matches(p,
+				slot[i].direction, slot[i].ubytes, slot[i].ulen);
+			results[slot[i].k] = match;
+			found += match != 0;
+
+			if (next < n) {
+				slot[i].k = next++;
+				slot[i].p = NULL;
+			}
+			else {
+				slot[i] = slot[--active];
+				if (i >= active) {
+					i = 0;
+				}
+				continue;
+			}
+		}
+
+		if (++i >= active) {
+			i = 0;
 		}
 	}
 
-	leaf = p->child[direction].leaf;
-	llen = cb_get_keylen(leaf);
+	return found;
+}
+
+/*! Returns the value slot stored with str, or NULL if str is not in tree */
+void *cb_tree_get(cb_tree_t *tree, const char *str)
+{
+	return cb_tree_get_n(tree, str, strlen(str));
+}
+
+/*! Returns the value slot stored with the len bytes at key, or NULL if
+the key is not in tree */
+void *cb_tree_get_n(cb_tree_t *tree, const void *key, size_t len)
+{
+	const cb_leaf_t *leaf;
+	if (len > MAX_KEYLEN) {
+		return NULL;
+	}
+	leaf = cb_tree_find_i(tree, (const cb_byte_t *)key, len);
+	return leaf ? cb_get_value(leaf) : NULL;
+}
+
+/*
+Compares a leaf key with another key, and finds their critical bit: the
+byte position and the mask for it (PREFIX_MASK if one key is a prefix of
+the other) are stored in critbyte and critbits, and the direction the
+leaf key would take on a node for them is returned. critbits is set to
+zero if the keys are identical.
+*/
+static int cb_find_crit(const cb_byte_t *lbytes, cb_keylen_t llen,
+	const cb_byte_t *ubytes, cb_keylen_t ulen,
+	cb_keylen_t *critbyte, cb_keylen_t *critbits)
+{
+	cb_keylen_t clen, newbyte, newotherbits;
+	int newdirection;
 
-	/* compare the new key with the leaf: find the comparison length, and
-	default values for the new mask and direction */
+	/* find the comparison length, and default values for the new mask and
+	direction */
 	if (llen < ulen) {
 		/* the leaf could be a prefix of the new key */
 		clen = llen;
@@ -254,266 +1119,1851 @@ static int cb_tree_insert_node(cb_tree_t *tree, cb_node_t *newnode, cb_byte_t *u
 	}
 
 	for (newbyte = 0; newbyte < clen; ++newbyte) {
-		if (leaf[newbyte] != ubytes[newbyte]) {
-			newotherbits = leaf[newbyte] ^ ubytes[newbyte];
+		if (lbytes[newbyte] != ubytes[newbyte]) {
+			newotherbits = lbytes[newbyte] ^ ubytes[newbyte];
 			/* different_byte_found */
 			newotherbits |= newotherbits >> 1;
 			newotherbits |= newotherbits >> 2;
 			newotherbits |= newotherbits >> 4;
 			/* (set just the bits above msb) | (move msb out of the way) */
 			newotherbits = (newotherbits ^ 255) | (newotherbits >> 1);
-			c = leaf[newbyte];
-			newdirection = (1 + (newotherbits | c)) >> 8;
+			newdirection = (1 + (newotherbits | lbytes[newbyte])) >> 8;
 			break;
 		}
 	}
 
-	if (newotherbits == 0) {
-		return 1;
-	}
-
-	newnode->byte = newbyte;
-	newnode->otherbits = newotherbits;
-	newnode->child[1 - newdirection].leaf = ubytes;
-	newnode->type[1 - newdirection] = TYPE_LEAF;
-
-	/* Insert into tree */
-	p = tree->root;
-	direction = ROOT_DIRECTION;
-
-	/* The prefix node mask shoud conceptually be lower than any other mask
-	value, since a prefix will come before any other byte comparison with
-	the same offset. However, its value is higher than any other mask.
-	The increment-and-mask changes it to zero, without affecting any other
-	comparison result. */
-	newotherbits = (newotherbits + 1) & 0xff;
-
-	while (p->type[direction] == TYPE_NODE) {
-		cb_node_t *q = p->child[direction].node;
-		if (q->byte >= newbyte) {
-			if (q->byte > newbyte) {
-				break;
-			}
-			else if (((q->otherbits + 1) & 0xff) > newotherbits) {
-				break;
-			}
-		}
+	*critbyte = newbyte;
+	*critbits = newotherbits;
+	return newdirection;
+}
 
-		direction = 0;
-		if (q->byte < ulen) {
-			c = ubytes[q->byte];
-			direction = (1 + (q->otherbits | c)) >> 8;
-		}
-		p = q;
+/*
+Returns non-zero if node q tests a bit after the critical bit given by
+critbyte and critbits, i.e. if a node for them belongs above q.
+The prefix node mask shoud conceptually be lower than any other mask
+value, since a prefix will come before any other byte comparison with
+the same offset. However, its value is higher than any other mask.
+The increment-and-mask changes it to zero, without affecting any other
+comparison result.
+*/
+static int cb_crit_after(const cb_node_t *q, cb_keylen_t critbyte,
+	cb_keylen_t critbits)
+{
+	if (q->byte != critbyte) {
+		return q->byte > critbyte;
 	}
-
-	newnode->child[newdirection] = p->child[direction];
-	newnode->type[newdirection] = p->type[direction];
-	p->child[direction].node = newnode;
-	p->type[direction] = TYPE_NODE;
-
-	return 0;
+	return ((q->otherbits + 1) & 0xff) > ((critbits + 1) & 0xff);
 }
 
+
 /*! Inserts str into tree, returns 0 on success */
 int cb_tree_insert(cb_tree_t *tree, const char *str)
 {
-	const size_t ulen = strlen(str);
-	cb_byte_t *x;
-	char * buffer;
-	cb_node_t *newnode;
-	int res;
-
-	buffer = (char*)tree->malloc(sizeof (cb_node_t) + ulen + 1, tree->baton);
-	if (buffer == NULL) {
-		return ENOMEM;
-	}
+	return cb_tree_insert_n(tree, str, strlen(str));
+}
 
-	newnode = (cb_node_t *) buffer;
-	x = (cb_byte_t *)(buffer + sizeof (cb_node_t));
-	memcpy(x, str, ulen + 1);
-	res = cb_tree_insert_node (tree, newnode, x);
-	if (res != 0) {
-		free(buffer);
-	}
+/*! Inserts the len bytes at key into tree, returns 0 on success */
+int cb_tree_insert_n(cb_tree_t *tree, const void *key, size_t len)
+{
+	void *value;
+	return cb_tree_insert_value_n(tree, key, len, 0, &value);
+}
 
-	return res;
+/*! Inserts str into tree with a value slot of valsize bytes, returns 0 on
+success */
+int cb_tree_insert_value(cb_tree_t *tree, const char *str, size_t valsize,
+	void **value)
+{
+	return cb_tree_insert_value_n(tree, str, strlen(str), valsize, value);
 }
 
-static int cb_tree_delete_i(cb_tree_t *tree, const cb_byte_t *ubytes,
-  int offset_node_from_leaf, cb_byte_t ** deleted_leaf)
+/*
+A path records the nodes visited by a search and the direction taken at
+each of them, starting with the root. Only the first PATH_SIZE steps are
+recorded: deeper insertions fall back to walking down from the last one.
+The recorded steps stay valid for any key that agrees with the searched
+key on all the bits they test, which lets a path be reused.
+*/
+#define PATH_SIZE 64
+
+typedef struct {
+	cb_node_t *node[PATH_SIZE];
+	unsigned char dir[PATH_SIZE];
+	size_t depth;
+} cb_path_t;
+
+/* Inserts newnode like cb_tree_insert_node(), continuing the search from
+the end of path, which must be a prefix of the new key's path (or empty).
+On return, path is a prefix of the path to the new or existing key. */
+static int cb_tree_insert_path(cb_tree_t *tree, cb_node_t *newnode,
+	cb_leaf_t *newleaf, const cb_leaf_t **existing, cb_path_t *path)
 {
-	const cb_keylen_t ulen = cb_get_keylen(ubytes);
+	const cb_byte_t *ubytes = cb_get_key(newleaf);
+	const cb_keylen_t ulen = cb_get_keylen(newleaf);
 	cb_node_t *p;
-	cb_node_t *q;
-	cb_node_t *lnode;
-	int direction;
-	int pdirection;
-	cb_byte_t *leaf;
-	cb_keylen_t llen;
+	const cb_leaf_t *leaf;
+	cb_keylen_t newbyte;
+	cb_keylen_t newotherbits;
+	int direction, newdirection;
+	int complete = 1;
+	size_t k;
 
 	if (tree->root == NULL) {
-		return 1;
+		memset (newnode, 0, sizeof (*newnode));
+		newnode->child[ROOT_DIRECTION] = cb_leaf_child(newnode);
+		STORE_RELEASE(tree->root, newnode);
+		if (tree->counted) {
+			COUNT(newnode) = 1;
+		}
+		path->depth = 0;
+	}
+	if (path->depth == 0) {
+		path->node[0] = tree->root;
+		path->dir[0] = ROOT_DIRECTION;
+		path->depth = 1;
+		if (tree->root == newnode) {
+			return 0;
+		}
 	}
 
-	p = NULL;
-	q = tree->root;
-	pdirection = direction = ROOT_DIRECTION;
-
-	while (q->type[direction] == TYPE_NODE) {
-		p = q;
-		pdirection = direction;
-		q = q->child[direction].node;
-
+	p = path->node[path->depth - 1];
+	direction = path->dir[path->depth - 1];
+	while (IS_NODE(p->child[direction])) {
+		p = NODE(p->child[direction]);
 		direction = 0;
-		if (q->byte < ulen) {
-			cb_byte_t c = ubytes[q->byte];
-			direction = (1 + (q->otherbits | c)) >> 8;
+		if (p->byte < ulen) {
+			cb_byte_t c = ubytes[p->byte];
+			direction = (1 + (p->otherbits | c)) >> 8;
+		}
+		if (path->depth < PATH_SIZE) {
+			path->node[path->depth] = p;
+			path->dir[path->depth] = direction;
+			path->depth++;
+		}
+		else {
+			complete = 0;
 		}
 	}
 
-	leaf = q->child[direction].leaf;
-	llen = cb_get_keylen(leaf);
-
-	if (llen != ulen || memcmp(ubytes, leaf, ulen) != 0) {
+	leaf = cb_child_leaf(p, direction);
+	newdirection = cb_find_crit(cb_get_key(leaf), cb_get_keylen(leaf),
+		ubytes, ulen, &newbyte, &newotherbits);
+	if (newotherbits == 0) {
+		*existing = leaf;
 		return 1;
 	}
 
-	/* get the node allocated together with this leaf */
-	lnode = (cb_node_t*) ((char*)leaf + offset_node_from_leaf);
+	newnode->byte = newbyte;
+	newnode->otherbits = newotherbits;
+	newnode->child[1 - newdirection] = cb_leaf_child(newnode);
 
-	if (p == NULL) {
-		tree->root = NULL;
-	}
-	else if (lnode == q) {
-		/* the leaf node will be unused */
-		p->child[pdirection] = q->child[1 - direction];
-		p->type[pdirection] = q->type[1 - direction];
+	/* The new node goes above the first recorded node testing a later bit */
+	for (k = 1; k < path->depth; k++) {
+		if (cb_crit_after(path->node[k], newbyte, newotherbits)) {
+			break;
+		}
 	}
-	else if (lnode == tree->root) {
-		p->child[pdirection] = q->child[1 - direction];
-		p->type[pdirection] = q->type[1 - direction];
-		*q = *lnode;
-		tree->root = q;
+	if (tree->counted) {
+		size_t i;
+		for (i = 0; i < k; i++) {
+			COUNT(path->node[i])++;
+		}
 	}
-	else {
-		/* The leaf node it still in use inside the tree, as one of our
-		ancestors: replace it with the removed node q.
-		See https://dotat.at/prog/qp/blog-2015-10-07.html for a detailed argument
-		about why the leaf node must always be an ancestor of the removed leaf. */
-		cb_node_t *t = tree->root;
-		int tdirection = ROOT_DIRECTION;
-		while (t->type[tdirection] == TYPE_NODE) {
-			if (t->child[tdirection].node == lnode) {
-				p->child[pdirection] = q->child[1 - direction];
-				p->type[pdirection] = q->type[1 - direction];
-				*q = *lnode;
-				t->child[tdirection].node = q;
+	p = path->node[k - 1];
+	direction = path->dir[k - 1];
+
+	if (k == path->depth && !complete) {
+		while (IS_NODE(p->child[direction])) {
+			cb_node_t *q = NODE(p->child[direction]);
+			if (cb_crit_after(q, newbyte, newotherbits)) {
 				break;
 			}
-			t = t->child[tdirection].node;
-			tdirection = 0;
-			if (t->byte < ulen) {
-				cb_byte_t c = ubytes[t->byte];
-				tdirection = (1 + (t->otherbits | c)) >> 8;
+			if (tree->counted) {
+				COUNT(q)++;
 			}
+			direction = 0;
+			if (q->byte < ulen) {
+				cb_byte_t c = ubytes[q->byte];
+				direction = (1 + (q->otherbits | c)) >> 8;
+			}
+			p = q;
+		}
+	}
+	else {
+		path->depth = k;
+		if (k < PATH_SIZE) {
+			path->node[k] = newnode;
+			path->dir[k] = 1 - newdirection;
+			path->depth++;
 		}
-		assert (t->type[tdirection] == TYPE_NODE);
 	}
 
-	*deleted_leaf = leaf;
+	newnode->child[newdirection] = cb_move_child(p, direction);
+	STORE_RELEASE(p->child[direction], TAG_NODE(newnode));
+	if (tree->counted) {
+		COUNT(newnode) = cb_child_count(newnode->child[newdirection]) + 1;
+	}
+
 	return 0;
 }
 
-/*! Deletes str from the tree, returns 0 on success */
-int cb_tree_delete(cb_tree_t *tree, const char *str)
+/*
+Concurrent insertions only ever change a child slot from a node or leaf
+testing a later bit than the new node to the new node, with a single
+compare-and-swap. The slots above the insertion point keep pointing to
+nodes testing earlier bits, so the insertion point found on the path of
+the descent is still correct if its slot is unchanged, unless another
+insertion published a key closer to the new one, which then shows up as
+a node testing the same bit. In both cases, the insertion starts over.
+*/
+static int cb_tree_insert_cas(cb_tree_t *tree, cb_node_t *newnode,
+	cb_leaf_t *newleaf, const cb_leaf_t **existing)
 {
-	const cb_byte_t *ubytes = (const cb_byte_t *)str;
-	cb_byte_t *leaf;
-	int res;
-	int offset = -((int)sizeof(cb_node_t));
+	const cb_byte_t *ubytes = cb_get_key(newleaf);
+	const cb_keylen_t ulen = cb_get_keylen(newleaf);
+	cb_path_t path;
+
+	for (;;) {
+		cb_node_t *p = LOAD_ACQUIRE(tree->root);
+		cb_node_t *empty = NULL;
+		const cb_leaf_t *leaf;
+		cb_keylen_t newbyte;
+		cb_keylen_t newotherbits;
+		int direction, newdirection;
+		int complete = 1;
+		void *child;
+		size_t k;
+
+		if (p == NULL) {
+			memset (newnode, 0, sizeof (*newnode));
+			newnode->child[ROOT_DIRECTION] = cb_leaf_child(newnode);
+			if (CAS(tree->root, empty, newnode)) {
+				return 0;
+			}
+			continue;
+		}
 
-	res = cb_tree_delete_i(tree, ubytes, offset, &leaf);
+		path.node[0] = p;
+		path.dir[0] = ROOT_DIRECTION;
+		path.depth = 1;
+		child = LOAD_ACQUIRE(p->child[ROOT_DIRECTION]);
+		while (IS_NODE(child)) {
+			p = NODE(child);
+			direction = 0;
+			if (p->byte < ulen) {
+				cb_byte_t c = ubytes[p->byte];
+				direction = (1 + (p->otherbits | c)) >> 8;
+			}
+			if (path.depth < PATH_SIZE) {
+				path.node[path.depth] = p;
+				path.dir[path.depth] = direction;
+				path.depth++;
+			}
+			else {
+				complete = 0;
+			}
+			child = LOAD_ACQUIRE(p->child[direction]);
+		}
 
-	if (res == 0) {
-		char* buffer = (char*)leaf + offset;
-		free(buffer);
-	}
+		leaf = IS_INLINE(child) ? (cb_leaf_t *)(p + 1) : LEAF(child);
+		newdirection = cb_find_crit(cb_get_key(leaf), cb_get_keylen(leaf),
+			ubytes, ulen, &newbyte, &newotherbits);
+		if (newotherbits == 0) {
+			*existing = leaf;
+			return 1;
+		}
 
-	return res;
-}
+		newnode->byte = newbyte;
+		newnode->otherbits = newotherbits;
+		newnode->child[1 - newdirection] = cb_leaf_child(newnode);
 
-/*! Clears the given tree */
-void cb_tree_clear(cb_tree_t *tree)
-{
-	if (tree->root != NULL) {
-		cbt_traverse_delete(tree, tree->root, 0);
-		tree->free(tree->root, tree->baton);
+		for (k = 1; k < path.depth; k++) {
+			cb_node_t *q = path.node[k];
+			if (cb_crit_after(q, newbyte, newotherbits) ||
+					(q->byte == newbyte && q->otherbits == newotherbits)) {
+				break;
+			}
+		}
+		p = path.node[k - 1];
+		direction = path.dir[k - 1];
+		if (k < path.depth) {
+			child = TAG_NODE(path.node[k]);
+		}
+		else if (!complete) {
+			child = LOAD_ACQUIRE(p->child[direction]);
+			while (IS_NODE(child)) {
+				cb_node_t *q = NODE(child);
+				if (cb_crit_after(q, newbyte, newotherbits) ||
+						(q->byte == newbyte && q->otherbits == newotherbits)) {
+					break;
+				}
+				direction = 0;
+				if (q->byte < ulen) {
+					cb_byte_t c = ubytes[q->byte];
+					direction = (1 + (q->otherbits | c)) >> 8;
+				}
+				p = q;
+				child = LOAD_ACQUIRE(p->child[direction]);
+			}
+		}
+		if (IS_NODE(child) && !cb_crit_after(NODE(child), newbyte, newotherbits)) {
+			continue;
+		}
+
+		newnode->child[newdirection] = IS_INLINE(child) ? (void *)(p + 1) : child;
+		if (CAS(p->child[direction], child, TAG_NODE(newnode))) {
+			return 0;
+		}
 	}
-	tree->root = NULL;
 }
 
-static int cb_tree_walk_prefixed_i(cb_tree_t *tree,
-	const cb_byte_t *prefix, cb_keylen_t prefixlen,
-	int (*callback)(const cb_byte_t *, void *), void *baton)
+/* Inserts newnode into a persistent tree, copying the nodes shared with
+other versions on the way to the insertion point. Returns ENOMEM if a copy
+failed, leaving the tree unchanged. */
+static int cb_tree_insert_persistent(cb_tree_t *tree, cb_node_t *newnode,
+	cb_leaf_t *newleaf, const cb_leaf_t **existing)
 {
+	const cb_byte_t *ubytes = cb_get_key(newleaf);
+	const cb_keylen_t ulen = cb_get_keylen(newleaf);
 	cb_node_t *p;
-	int direction;
-	cb_node_t *top;
-	int tdirection;
-	const cb_byte_t *leaf;
-	cb_keylen_t llen;
+	const cb_leaf_t *leaf;
+	cb_keylen_t newbyte;
+	cb_keylen_t newotherbits;
+	int direction, newdirection;
+
+	/* referenced by its parent and by the node holding its leaf */
+	BLOCK_REFS(newnode) = 2;
+	NODE_REFS(newnode) = 1;
 
 	if (tree->root == NULL) {
+		memset (newnode, 0, sizeof (*newnode));
+		newnode->child[ROOT_DIRECTION] = newleaf;
+		tree->root = newnode;
 		return 0;
 	}
 
-	top = p = tree->root;
-	tdirection = direction = ROOT_DIRECTION;
-
-	while (p->type[direction] == TYPE_NODE) {
-		cb_node_t *q = p->child[direction].node;
-
+	p = tree->root;
+	direction = ROOT_DIRECTION;
+	while (IS_NODE(p->child[direction])) {
+		p = NODE(p->child[direction]);
 		direction = 0;
-		if (q->byte < prefixlen) {
-			cb_byte_t c = prefix[q->byte];
-			direction = (1 + (q->otherbits | c)) >> 8;
-			top = q;
-			tdirection = direction;
+		if (p->byte < ulen) {
+			cb_byte_t c = ubytes[p->byte];
+			direction = (1 + (p->otherbits | c)) >> 8;
 		}
+	}
 
-		p = q;
+	leaf = LEAF(p->child[direction]);
+	newdirection = cb_find_crit(cb_get_key(leaf), cb_get_keylen(leaf),
+		ubytes, ulen, &newbyte, &newotherbits);
+	if (newotherbits == 0) {
+		*existing = leaf;
+		return 1;
 	}
 
-	leaf = p->child[direction].leaf;
-	llen = cb_get_keylen(leaf);
-	if (llen < prefixlen || memcmp(leaf, prefix, prefixlen) != 0) {
-		/* No strings match */
-		return 0;
+	newnode->byte = newbyte;
+	newnode->otherbits = newotherbits;
+	newnode->child[1 - newdirection] = newleaf;
+
+	p = cb_persist_own_root(tree);
+	direction = ROOT_DIRECTION;
+	while (p != NULL && IS_NODE(p->child[direction]) &&
+			!cb_crit_after(NODE(p->child[direction]), newbyte, newotherbits)) {
+		p = cb_persist_own(tree, &p->child[direction]);
+		if (p != NULL) {
+			direction = 0;
+			if (p->byte < ulen) {
+				cb_byte_t c = ubytes[p->byte];
+				direction = (1 + (p->otherbits | c)) >> 8;
+			}
+		}
+	}
+	if (p == NULL) {
+		return ENOMEM;
 	}
 
-	return cbt_traverse_prefixed(top, tdirection, callback, baton);
+	newnode->child[newdirection] = p->child[direction];
+	p->child[direction] = TAG_NODE(newnode);
+	return 0;
 }
 
-struct callback_str {
-	int (*callback)(const char *, void *);
-	void * baton;
-};
-
-static int callback_str_wrapper(const cb_byte_t * key, void * baton)
+/* Inserts newnode in a single descent, finding the insertion point on the
+recorded path instead of walking down again from the root */
+static int cb_tree_insert_node(cb_tree_t *tree, cb_node_t *newnode,
+	cb_leaf_t *newleaf, const cb_leaf_t **existing)
 {
-	struct callback_str *param = (struct callback_str *)baton;
-	return param->callback((const char*)key, param->baton);
+	cb_path_t path;
+	if (tree->concurrent) {
+		return cb_tree_insert_cas(tree, newnode, newleaf, existing);
+	}
+	if (tree->persistent) {
+		return cb_tree_insert_persistent(tree, newnode, newleaf, existing);
+	}
+	path.depth = 0;
+	return cb_tree_insert_path(tree, newnode, newleaf, existing, &path);
 }
 
-/*! Calls callback for all strings in tree with the given prefix */
-int cb_tree_walk_prefixed(cb_tree_t *tree, const char *prefix,
-	int (*callback)(const char *, void *), void *baton)
+/* Allocates the block for a key, with its node and leaf. Returns the node,
+or NULL if the allocation failed. */
+static cb_node_t *cb_alloc_key(cb_tree_t *tree, const void *key,
+	cb_keylen_t len, cb_keylen_t flags, size_t valsize)
 {
-	struct callback_str param;
-	param.callback = callback;
+	cb_leaf_t *leaf;
+	char * buffer;
+	cb_node_t *newnode;
+	size_t size;
+
+	size = cb_get_value_offset(len | flags) + valsize;
+	if (tree->persistent) {
+		size += REFS_SIZE;
+	}
+	else if (tree->counted) {
+		size += COUNT_SIZE;
+	}
+	buffer = (char*)tree->malloc(size, tree->baton);
+	if (buffer == NULL) {
+		return NULL;
+	}
+
+	newnode = (cb_node_t *)buffer;
+	if (tree->persistent) {
+		newnode = (cb_node_t *)(buffer + REFS_SIZE);
+	}
+	else if (tree->counted) {
+		newnode = (cb_node_t *)(buffer + COUNT_SIZE);
+	}
+	leaf = (cb_leaf_t *)(newnode + 1);
+	leaf->len = len | flags;
+	if (flags & BORROWED) {
+		((cb_borrowed_leaf_t *)leaf)->key = (const cb_byte_t *)key;
+	}
+	else {
+		cb_byte_t *x = (cb_byte_t *)(leaf + 1);
+		memcpy(x, key, len);
+		x[len] = 0;
+	}
+	return newnode;
+}
+
+static int cb_tree_insert_i(cb_tree_t *tree, const void *key, size_t len,
+	cb_keylen_t flags, size_t valsize, void **value)
+{
+	const cb_leaf_t *existing;
+	cb_leaf_t *leaf;
+	cb_node_t *newnode;
+	int res;
+
+	if (len > MAX_KEYLEN) {
+		return EINVAL;
+	}
+
+	newnode = cb_alloc_key(tree, key, (cb_keylen_t)len, flags, valsize);
+	if (newnode == NULL) {
+		return ENOMEM;
+	}
+	leaf = (cb_leaf_t *)(newnode + 1);
+
+	res = cb_tree_insert_node (tree, newnode, leaf, &existing);
+	if (res != 0) {
+		tree->free(cb_node_block(tree, newnode), tree->baton);
+	}
+	if (res == 1) {
+		*value = cb_get_value(existing);
+	}
+	else {
+		*value = cb_get_value(leaf);
+	}
+
+	return res;
+}
+
+/*! Inserts the len bytes at key into tree with a value slot of valsize
+bytes, returns 0 on success */
+int cb_tree_insert_value_n(cb_tree_t *tree, const void *key, size_t len,
+	size_t valsize, void **value)
+{
+	return cb_tree_insert_i(tree, key, len, 0, valsize, value);
+}
+
+/*! Inserts str into tree without copying it, returns 0 on success */
+int cb_tree_insert_ref(cb_tree_t *tree, const char *str)
+{
+	return cb_tree_insert_ref_n(tree, str, strlen(str));
+}
+
+/*! Inserts the len bytes at key into tree without copying them, returns 0
+on success */
+int cb_tree_insert_ref_n(cb_tree_t *tree, const void *key, size_t len)
+{
+	void *value;
+	return cb_tree_insert_i(tree, key, len, BORROWED, 0, &value);
+}
+
+/*! Inserts the len bytes at key into tree without copying them, with a
+value slot of valsize bytes, returns 0 on success */
+int cb_tree_insert_value_ref_n(cb_tree_t *tree, const void *key, size_t len,
+	size_t valsize, void **value)
+{
+	return cb_tree_insert_i(tree, key, len, BORROWED, valsize, value);
+}
+
+/*! Inserts n keys into tree, reusing the search path of each key for
+the next one */
+int cb_tree_insert_batch(cb_tree_t *tree, const void *const *keys,
+	const size_t *lens, size_t n, size_t *inserted)
+{
+	cb_path_t path;
+	const cb_byte_t *prev = NULL;
+	size_t prevlen = 0, i;
+	int res;
+
+	path.depth = 0;
+	*inserted = 0;
+	for (i = 0; i < n; i++) {
+		const cb_byte_t *ubytes = (const cb_byte_t *)keys[i];
+		size_t len = lens ? lens[i] : strlen((const char *)keys[i]);
+		const cb_leaf_t *existing;
+		cb_node_t *newnode;
+
+		if (len > MAX_KEYLEN) {
+			return EINVAL;
+		}
+
+		/* Keep the steps testing bits before the first difference from the
+		previous key, where both keys take the same direction */
+		if (prev != NULL) {
+			cb_keylen_t critbyte, critbits;
+			cb_find_crit(prev, prevlen, ubytes, len, &critbyte, &critbits);
+			if (critbits != 0) {
+				size_t k;
+				for (k = 1; k < path.depth; k++) {
+					cb_node_t *q = path.node[k];
+					if (cb_crit_after(q, critbyte, critbits) ||
+							(q->byte == critbyte && q->otherbits == critbits)) {
+						break;
+					}
+				}
+				path.depth = k;
+			}
+		}
+
+		newnode = cb_alloc_key(tree, ubytes, len, 0, 0);
+		if (newnode == NULL) {
+			return ENOMEM;
+		}
+		if (tree->concurrent || tree->persistent) {
+			res = cb_tree_insert_node(tree, newnode, (cb_leaf_t *)(newnode + 1),
+				&existing);
+		}
+		else {
+			res = cb_tree_insert_path(tree, newnode, (cb_leaf_t *)(newnode + 1),
+				&existing, &path);
+		}
+		if (res != 0) {
+			tree->free(cb_node_block(tree, newnode), tree->baton);
+		}
+		if (res == ENOMEM) {
+			return ENOMEM;
+		}
+		else if (res == 0) {
+			(*inserted)++;
+		}
+		prev = ubytes;
+		prevlen = len;
+	}
+	return 0;
+}
+
+/*
+Sorted keys are built into a tree bottom-up: the node for each pair of
+adjacent keys has their critical bit, and the tree is the Cartesian tree
+of these nodes ordered by their bit positions, built with the usual stack
+of its right spine. The node for a pair is allocated with its second key,
+since it is an ancestor of that key's leaf, and the root with the first
+key. Nodes on the stack have no right child yet, so the stack is linked
+through that child.
+*/
+
+/* Returns the child to store in par for the leaf of the key owning node */
+static void *cb_build_leaf(cb_node_t *par, cb_node_t *node)
+{
+	if (par == node) {
+		return cb_leaf_child(node);
+	}
+	return (cb_leaf_t *)(node + 1);
+}
+
+/* Sets the right child of a node taken from the stack */
+static void cb_build_close(cb_tree_t *tree, cb_node_t *node, void *right)
+{
+	node->child[1] = right;
+	if (tree->counted) {
+		COUNT(node) = cb_child_count(node->child[0]) + cb_child_count(right);
+	}
+}
+
+/* Closes all nodes on the stack and attaches them below the root */
+static void cb_build_finish(cb_tree_t *tree, cb_node_t *root, cb_node_t *stack,
+	cb_node_t *last)
+{
+	void *child = NULL;
+	while (stack != NULL) {
+		cb_node_t *next = (cb_node_t *)stack->child[1];
+		cb_build_close(tree, stack, child ? child : cb_build_leaf(stack, last));
+		child = TAG_NODE(stack);
+		stack = next;
+	}
+	root->child[0] = NULL;
+	root->child[ROOT_DIRECTION] = child ? child : cb_build_leaf(root, last);
+	if (tree->counted) {
+		COUNT(root) = cb_child_count(root->child[ROOT_DIRECTION]);
+	}
+	tree->root = root;
+}
+
+/*! Builds an empty tree from n keys in strictly increasing order */
+int cb_tree_build_sorted(cb_tree_t *tree, const void *const *keys,
+	const size_t *lens, size_t n)
+{
+	cb_node_t *root = NULL, *prev = NULL, *stack = NULL;
+	size_t i;
+
+	if (tree->root != NULL || tree->persistent) {
+		return EINVAL;
+	}
+	for (i = 0; i < n; i++) {
+		size_t len = lens ? lens[i] : strlen((const char *)keys[i]);
+		if (len > MAX_KEYLEN) {
+			return EINVAL;
+		}
+		if (i > 0) {
+			size_t plen = lens ? lens[i - 1] : strlen((const char *)keys[i - 1]);
+			cb_keylen_t critbyte, critbits;
+			if (cb_find_crit((const cb_byte_t *)keys[i - 1], plen,
+					(const cb_byte_t *)keys[i], len, &critbyte, &critbits) != 0 ||
+					critbits == 0) {
+				return EINVAL;
+			}
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		size_t len = lens ? lens[i] : strlen((const char *)keys[i]);
+		cb_node_t *node = cb_alloc_key(tree, keys[i], len, 0, 0);
+		const cb_leaf_t *pleaf;
+		cb_keylen_t critbits;
+		void *left = NULL;
+
+		if (node == NULL) {
+			if (root != NULL) {
+				cb_build_finish(tree, root, stack, prev);
+				cb_tree_clear(tree);
+			}
+			return ENOMEM;
+		}
+		if (root == NULL) {
+			root = prev = node;
+			continue;
+		}
+
+		pleaf = (const cb_leaf_t *)(prev + 1);
+		cb_find_crit(cb_get_key(pleaf), cb_get_keylen(pleaf),
+			(const cb_byte_t *)keys[i], len, &node->byte, &critbits);
+		node->otherbits = critbits;
+		while (stack != NULL && cb_crit_after(stack, node->byte, node->otherbits)) {
+			cb_node_t *next = (cb_node_t *)stack->child[1];
+			cb_build_close(tree, stack, left ? left : cb_build_leaf(stack, prev));
+			left = TAG_NODE(stack);
+			stack = next;
+		}
+		node->child[0] = left ? left : cb_build_leaf(node, prev);
+		node->child[1] = stack;
+		stack = node;
+		prev = node;
+	}
+
+	if (root != NULL) {
+		cb_build_finish(tree, root, stack, prev);
+	}
+	return 0;
+}
+
+/* Walks down from the last step of an incomplete path to the parent of
+node, which must be on the path of the key */
+static void cb_path_find(cb_path_t *path, const cb_node_t *node,
+	const cb_byte_t *ubytes, cb_keylen_t ulen, cb_node_t **par, int *dir)
+{
+	cb_node_t *t = path->node[path->depth - 1];
+	int tdirection = path->dir[path->depth - 1];
+	while (NODE(t->child[tdirection]) != node) {
+		t = NODE(t->child[tdirection]);
+		tdirection = 0;
+		if (t->byte < ulen) {
+			cb_byte_t c = ubytes[t->byte];
+			tdirection = (1 + (t->otherbits | c)) >> 8;
+		}
+	}
+	*par = t;
+	*dir = tdirection;
+}
+
+static int cb_tree_delete_i(cb_tree_t *tree, const cb_byte_t *ubytes,
+  cb_keylen_t ulen, cb_node_t ** deleted_node)
+{
+	cb_path_t path;
+	cb_node_t *p;
+	cb_node_t *q;
+	cb_node_t *lnode;
+	int direction;
+	int pdirection;
+	int complete = 1;
+	size_t k;
+
+	if (tree->root == NULL) {
+		return 1;
+	}
+
+	p = NULL;
+	q = tree->root;
+	pdirection = direction = ROOT_DIRECTION;
+	path.node[0] = q;
+	path.dir[0] = direction;
+	path.depth = 1;
+
+	while (IS_NODE(q->child[direction])) {
+		p = q;
+		pdirection = direction;
+		q = NODE(q->child[direction]);
+
+		direction = 0;
+		if (q->byte < ulen) {
+			cb_byte_t c = ubytes[q->byte];
+			direction = (1 + (q->otherbits | c)) >> 8;
+		}
+		if (path.depth < PATH_SIZE) {
+			path.node[path.depth] = q;
+			path.dir[path.depth] = direction;
+			path.depth++;
+		}
+		else {
+			complete = 0;
+		}
+	}
+
+	if (!cb_child_matches(q, direction, ubytes, ulen)) {
+		return 1;
+	}
+
+	/* get the node allocated together with this leaf */
+	lnode = (cb_node_t*)cb_child_leaf(q, direction) - 1;
+
+	if (tree->counted) {
+		for (k = 0; k < path.depth; k++) {
+			COUNT(path.node[k])--;
+		}
+		if (!complete) {
+			cb_node_t *t = path.node[path.depth - 1];
+			int tdirection = path.dir[path.depth - 1];
+			while (IS_NODE(t->child[tdirection])) {
+				t = NODE(t->child[tdirection]);
+				COUNT(t)--;
+				tdirection = 0;
+				if (t->byte < ulen) {
+					cb_byte_t c = ubytes[t->byte];
+					tdirection = (1 + (t->otherbits | c)) >> 8;
+				}
+			}
+		}
+	}
+
+	if (p == NULL) {
+		STORE_RELEASE(tree->root, NULL);
+	}
+	else if (lnode == q) {
+		/* the leaf node will be unused */
+		STORE_RELEASE(p->child[pdirection], cb_move_child(q, 1 - direction));
+	}
+	else if (lnode == tree->root) {
+		cb_write_begin(tree);
+		STORE_RELEASE(p->child[pdirection], cb_move_child(q, 1 - direction));
+		*q = *lnode;
+		if (tree->counted) {
+			COUNT(q) = COUNT(lnode);
+		}
+		STORE_RELEASE(tree->root, q);
+		cb_write_end(tree);
+	}
+	else {
+		/* The leaf node it still in use inside the tree, as one of our
+		ancestors: replace it with the removed node q. Its parent is on the
+		recorded path, unless the path was too long to record.
+		See https://dotat.at/prog/qp/blog-2015-10-07.html for a detailed argument
+		about why the leaf node must always be an ancestor of the removed leaf. */
+		cb_node_t *t;
+		int tdirection;
+		for (k = 1; k < path.depth && path.node[k] != lnode; k++) {
+			continue;
+		}
+		if (k < path.depth) {
+			t = path.node[k - 1];
+			tdirection = path.dir[k - 1];
+		}
+		else {
+			assert (!complete);
+			cb_path_find(&path, lnode, ubytes, ulen, &t, &tdirection);
+		}
+		cb_write_begin(tree);
+		STORE_RELEASE(p->child[pdirection], cb_move_child(q, 1 - direction));
+		*q = *lnode;
+		if (tree->counted) {
+			COUNT(q) = COUNT(lnode);
+		}
+		STORE_RELEASE(t->child[tdirection], TAG_NODE(q));
+		cb_write_end(tree);
+	}
+
+	*deleted_node = lnode;
+	return 0;
+}
+
+/* Deletes a key from a persistent tree, copying the nodes shared with
+other versions on the way to the parent of its leaf. The parent is not
+copied: its other child takes its place, and the tree drops its reference
+to it. */
+static int cb_tree_delete_persistent(cb_tree_t *tree, const cb_byte_t *ubytes,
+	cb_keylen_t ulen)
+{
+	cb_node_t *p, *q;
+	void *sibling;
+	int direction, pdirection;
+
+	if (tree->root == NULL) {
+		return 1;
+	}
+
+	q = tree->root;
+	direction = ROOT_DIRECTION;
+	while (IS_NODE(q->child[direction])) {
+		q = NODE(q->child[direction]);
+		direction = 0;
+		if (q->byte < ulen) {
+			cb_byte_t c = ubytes[q->byte];
+			direction = (1 + (q->otherbits | c)) >> 8;
+		}
+	}
+	if (!cb_child_matches(q, direction, ubytes, ulen)) {
+		return 1;
+	}
+
+	if (q == tree->root) {
+		cb_persist_release(tree, TAG_NODE(tree->root));
+		tree->root = NULL;
+		return 0;
+	}
+
+	p = cb_persist_own_root(tree);
+	pdirection = ROOT_DIRECTION;
+	for (;;) {
+		if (p == NULL) {
+			return ENOMEM;
+		}
+		q = NODE(p->child[pdirection]);
+		direction = 0;
+		if (q->byte < ulen) {
+			cb_byte_t c = ubytes[q->byte];
+			direction = (1 + (q->otherbits | c)) >> 8;
+		}
+		if (!IS_NODE(q->child[direction])) {
+			break;
+		}
+		p = cb_persist_own(tree, &p->child[pdirection]);
+		pdirection = direction;
+	}
+
+	sibling = q->child[1 - direction];
+	cb_persist_ref(sibling);
+	p->child[pdirection] = sibling;
+	cb_persist_release(tree, TAG_NODE(q));
+	return 0;
+}
+
+/*! Deletes str from the tree, returns 0 on success */
+int cb_tree_delete(cb_tree_t *tree, const char *str)
+{
+	return cb_tree_delete_n(tree, str, strlen(str));
+}
+
+/*! Deletes the len bytes at key from the tree, returns 0 on success */
+int cb_tree_delete_n(cb_tree_t *tree, const void *key, size_t len)
+{
+	const cb_byte_t *ubytes = (const cb_byte_t *)key;
+	cb_node_t *lnode;
+	int res;
+
+	if (len > MAX_KEYLEN) {
+		return 1;
+	}
+	if (tree->persistent) {
+		return cb_tree_delete_persistent(tree, ubytes, len);
+	}
+	res = cb_tree_delete_i(tree, ubytes, len, &lnode);
+
+	if (res == 0 && tree->retire != NULL) {
+		tree->retire(cb_node_block(tree, lnode), tree->baton);
+	}
+	else if (res == 0) {
+		tree->free(cb_node_block(tree, lnode), tree->baton);
+	}
+
+	return res;
+}
+
+/*! Clears the given tree */
+void cb_tree_clear(cb_tree_t *tree)
+{
+	if (tree->persistent) {
+		if (tree->root != NULL) {
+			cb_persist_release(tree, TAG_NODE(tree->root));
+		}
+	}
+	else if (tree->clear != NULL) {
+		tree->clear(tree->baton);
+	}
+	else if (tree->root != NULL) {
+		cbt_traverse_delete(tree, tree->root, ROOT_DIRECTION);
+		tree->free(cb_node_block(tree, tree->root), tree->baton);
+	}
+	tree->root = NULL;
+}
+
+static int cb_tree_walk_prefixed_i(cb_tree_t *tree,
+	const cb_byte_t *prefix, cb_keylen_t prefixlen,
+	int (*callback)(const void *, size_t, void *), void *baton)
+{
+	cb_node_t *p;
+	int direction;
+	cb_node_t *top;
+	int tdirection;
+	const cb_leaf_t *leaf;
+	cb_keylen_t llen;
+
+	if (tree->root == NULL) {
+		return 0;
+	}
+
+	top = p = tree->root;
+	tdirection = direction = ROOT_DIRECTION;
+
+	while (IS_NODE(p->child[direction])) {
+		cb_node_t *q = NODE(p->child[direction]);
+
+		direction = 0;
+		if (q->byte < prefixlen) {
+			cb_byte_t c = prefix[q->byte];
+			direction = (1 + (q->otherbits | c)) >> 8;
+			top = q;
+			tdirection = direction;
+		}
+
+		p = q;
+	}
+
+	leaf = cb_child_leaf(p, direction);
+	llen = cb_get_keylen(leaf);
+	if (llen < prefixlen || memcmp(cb_get_key(leaf), prefix, prefixlen) != 0) {
+		/* No strings match */
+		return 0;
+	}
+
+	return cbt_traverse_prefixed(top, tdirection, callback, baton);
+}
+
+struct callback_str {
+	int (*callback)(const char *, void *);
+	void * baton;
+};
+
+static int callback_str_wrapper(const void * key, size_t len, void * baton)
+{
+	struct callback_str *param = (struct callback_str *)baton;
+	(void)len; /* Prevent compiler warnings */
+	return param->callback((const char*)key, param->baton);
+}
+
+/*! Calls callback for all strings in tree with the given prefix */
+int cb_tree_walk_prefixed(cb_tree_t *tree, const char *prefix,
+	int (*callback)(const char *, void *), void *baton)
+{
+	struct callback_str param;
+	param.callback = callback;
+	param.baton = baton;
+	return cb_tree_walk_prefixed_i(tree, (const cb_byte_t*)prefix,
+	  strlen(prefix), callback_str_wrapper, &param);
+}
+
+/*! Calls callback for all keys in tree starting with the len bytes at prefix */
+int cb_tree_walk_prefixed_n(cb_tree_t *tree, const void *prefix, size_t len,
+	int (*callback)(const void *, size_t, void *), void *baton)
+{
+	if (len > MAX_KEYLEN) {
+		return 0;
+	}
+	return cb_tree_walk_prefixed_i(tree, (const cb_byte_t*)prefix, len,
+	  callback, baton);
+}
+
+/*
+A key that is a proper prefix of the search key is always the left child
+of a prefix node on the search path, since it is the only key of its
+length below that node. The candidates are checked while descending: the
+bytes already compared are shared by all deeper keys, so each byte of the
+search key is compared at most once, and the first mismatch ends the
+search.
+*/
+static const void *cb_found_key(const cb_leaf_t *leaf, size_t *foundlen)
+{
+	if (leaf == NULL) {
+		return NULL;
+	}
+	*foundlen = cb_get_keylen(leaf);
+	return cb_get_key(leaf);
+}
+
+static const void *cb_tree_longest_prefix_i(cb_tree_t *tree,
+	const cb_byte_t *ubytes, cb_keylen_t ulen, size_t *foundlen)
+{
+	const cb_leaf_t *best = NULL, *leaf;
+	const cb_byte_t *lbytes;
+	cb_keylen_t checked = 0, llen;
+	cb_node_t *p;
+	int direction;
+
+	if (tree->root == NULL) {
+		return NULL;
+	}
+
+	p = tree->root;
+	direction = ROOT_DIRECTION;
+	while (IS_NODE(p->child[direction])) {
+		p = NODE(p->child[direction]);
+		direction = 0;
+		if (p->byte < ulen) {
+			cb_byte_t c = ubytes[p->byte];
+			direction = (1 + (p->otherbits | c)) >> 8;
+
+			if (p->otherbits == PREFIX_MASK && !IS_NODE(p->child[0])) {
+				leaf = cb_child_leaf(p, 0);
+				lbytes = cb_get_key(leaf);
+				if (memcmp(lbytes + checked, ubytes + checked, p->byte - checked) != 0) {
+					return cb_found_key(best, foundlen);
+				}
+				checked = p->byte;
+				best = leaf;
+			}
+		}
+	}
+
+	leaf = cb_child_leaf(p, direction);
+	llen = cb_get_keylen(leaf);
+	if (llen <= ulen && llen >= checked &&
+			memcmp(cb_get_key(leaf) + checked, ubytes + checked, llen - checked) == 0) {
+		best = leaf;
+	}
+	return cb_found_key(best, foundlen);
+}
+
+/*! Returns the longest key in tree that is a prefix of str, or NULL */
+const char *cb_tree_longest_prefix(cb_tree_t *tree, const char *str)
+{
+	size_t len;
+	return (const char *)cb_tree_longest_prefix_i(tree,
+		(const cb_byte_t *)str, strlen(str), &len);
+}
+
+/*! Returns the longest key in tree that is a prefix of the len bytes at key */
+const void *cb_tree_longest_prefix_n(cb_tree_t *tree, const void *key,
+	size_t len, size_t *foundlen)
+{
+	if (len > MAX_KEYLEN) {
+		/* no longer key can be stored */
+		len = MAX_KEYLEN;
+	}
+	return cb_tree_longest_prefix_i(tree, (const cb_byte_t *)key, len,
+		foundlen);
+}
+
+/*
+Neighbor queries find the critical bit between the key and its best
+match, then walk down again to where the key would be inserted, noting
+the last nodes where the path turned left and right. The subtree found
+there is entirely on one side of the key, and the neighbors are either
+its extreme keys or those of the subtrees beyond the last turns.
+A key longer than MAX_KEYLEN cannot be stored, so it is ordered like its
+first MAX_KEYLEN bytes, except that it is greater if those are a key.
+*/
+#define LOWER_BOUND 0
+#define SUCCESSOR 1
+#define PREDECESSOR 2
+
+/* Returns the leftmost (side 0) or rightmost (side 1) key below a child */
+static const cb_leaf_t *cb_extreme_leaf(cb_node_t *par, int dir, int side)
+{
+	while (IS_NODE(par->child[dir])) {
+		par = NODE(par->child[dir]);
+		dir = side;
+	}
+	return cb_child_leaf(par, dir);
+}
+
+static const void *cb_tree_neighbor_i(cb_tree_t *tree,
+	const cb_byte_t *ubytes, cb_keylen_t ulen, int mode, size_t *foundlen)
+{
+	const cb_leaf_t *leaf;
+	cb_keylen_t critbyte, critbits;
+	cb_node_t *p, *lastleft = NULL, *lastright = NULL;
+	int direction, critdirection;
+
+	if (tree->root == NULL) {
+		return NULL;
+	}
+
+	p = tree->root;
+	direction = ROOT_DIRECTION;
+	while (IS_NODE(p->child[direction])) {
+		p = NODE(p->child[direction]);
+		direction = 0;
+		if (p->byte < ulen) {
+			cb_byte_t c = ubytes[p->byte];
+			direction = (1 + (p->otherbits | c)) >> 8;
+		}
+	}
+	leaf = cb_child_leaf(p, direction);
+	critdirection = cb_find_crit(cb_get_key(leaf), cb_get_keylen(leaf),
+		ubytes, ulen, &critbyte, &critbits);
+
+	p = tree->root;
+	direction = ROOT_DIRECTION;
+	while (IS_NODE(p->child[direction])) {
+		cb_node_t *q = NODE(p->child[direction]);
+		if (critbits != 0 && cb_crit_after(q, critbyte, critbits)) {
+			break;
+		}
+		direction = 0;
+		if (q->byte < ulen) {
+			cb_byte_t c = ubytes[q->byte];
+			direction = (1 + (q->otherbits | c)) >> 8;
+		}
+		if (direction == 0) {
+			lastleft = q;
+		}
+		else {
+			lastright = q;
+		}
+		p = q;
+	}
+
+	if (critbits == 0 && mode == LOWER_BOUND) {
+		/* leaf is the key itself */
+	}
+	else if (critbits != 0 && critdirection == (mode != PREDECESSOR)) {
+		/* the subtree is on the side of the wanted neighbor */
+		leaf = cb_extreme_leaf(p, direction, mode == PREDECESSOR);
+	}
+	else if (mode == PREDECESSOR) {
+		if (lastright == NULL) {
+			return NULL;
+		}
+		leaf = cb_extreme_leaf(lastright, 0, 1);
+	}
+	else {
+		if (lastleft == NULL) {
+			return NULL;
+		}
+		leaf = cb_extreme_leaf(lastleft, 1, 0);
+	}
+
+	*foundlen = cb_get_keylen(leaf);
+	return cb_get_key(leaf);
+}
+
+/*! Returns the smallest key in tree not less than str, or NULL */
+const char *cb_tree_lower_bound(cb_tree_t *tree, const char *str)
+{
+	size_t len;
+	return (const char *)cb_tree_neighbor_i(tree, (const cb_byte_t *)str,
+		strlen(str), LOWER_BOUND, &len);
+}
+
+/*! Returns the smallest key in tree not less than the len bytes at key */
+const void *cb_tree_lower_bound_n(cb_tree_t *tree, const void *key,
+	size_t len, size_t *foundlen)
+{
+	if (len > MAX_KEYLEN) {
+		return cb_tree_neighbor_i(tree, (const cb_byte_t *)key, MAX_KEYLEN,
+			SUCCESSOR, foundlen);
+	}
+	return cb_tree_neighbor_i(tree, (const cb_byte_t *)key, len,
+		LOWER_BOUND, foundlen);
+}
+
+/*! Returns the smallest key in tree greater than str, or NULL */
+const char *cb_tree_successor(cb_tree_t *tree, const char *str)
+{
+	size_t len;
+	return (const char *)cb_tree_neighbor_i(tree, (const cb_byte_t *)str,
+		strlen(str), SUCCESSOR, &len);
+}
+
+/*! Returns the smallest key in tree greater than the len bytes at key */
+const void *cb_tree_successor_n(cb_tree_t *tree, const void *key,
+	size_t len, size_t *foundlen)
+{
+	if (len > MAX_KEYLEN) {
+		len = MAX_KEYLEN;
+	}
+	return cb_tree_neighbor_i(tree, (const cb_byte_t *)key, len,
+		SUCCESSOR, foundlen);
+}
+
+/*! Returns the greatest key in tree less than str, or NULL */
+const char *cb_tree_predecessor(cb_tree_t *tree, const char *str)
+{
+	size_t len;
+	return (const char *)cb_tree_neighbor_i(tree, (const cb_byte_t *)str,
+		strlen(str), PREDECESSOR, &len);
+}
+
+/*! Returns the greatest key in tree less than the len bytes at key */
+const void *cb_tree_predecessor_n(cb_tree_t *tree, const void *key,
+	size_t len, size_t *foundlen)
+{
+	if (len > MAX_KEYLEN) {
+		const void *found = cb_tree_neighbor_i(tree, (const cb_byte_t *)key,
+			MAX_KEYLEN, LOWER_BOUND, foundlen);
+		if (found != NULL && *foundlen == MAX_KEYLEN &&
+				memcmp(found, key, MAX_KEYLEN) == 0) {
+			return found;
+		}
+		len = MAX_KEYLEN;
+	}
+	return cb_tree_neighbor_i(tree, (const cb_byte_t *)key, len,
+		PREDECESSOR, foundlen);
+}
+
+static int count_cb(const void *key, size_t len, void *baton)
+{
+	(void)key; /* Prevent compiler warnings */
+	(void)len;
+	(*(size_t *)baton)++;
+	return 0;
+}
+
+/*! Returns the number of strings in tree with the given prefix */
+size_t cb_tree_count_prefixed(cb_tree_t *tree, const char *prefix)
+{
+	return cb_tree_count_prefixed_n(tree, prefix, strlen(prefix));
+}
+
+/*! Returns the number of keys in tree starting with the len bytes at
+prefix. Without subtree counts, the matching keys are walked. */
+size_t cb_tree_count_prefixed_n(cb_tree_t *tree, const void *prefix,
+	size_t len)
+{
+	const cb_byte_t *ubytes = (const cb_byte_t *)prefix;
+	const cb_leaf_t *leaf;
+	cb_node_t *p, *top;
+	int direction, tdirection;
+	size_t count = 0;
+
+	if (len > MAX_KEYLEN) {
+		return 0;
+	}
+	if (!tree->counted) {
+		cb_tree_walk_prefixed_n(tree, prefix, len, count_cb, &count);
+		return count;
+	}
+	if (tree->root == NULL) {
+		return 0;
+	}
+
+	top = p = tree->root;
+	tdirection = direction = ROOT_DIRECTION;
+	while (IS_NODE(p->child[direction])) {
+		cb_node_t *q = NODE(p->child[direction]);
+		direction = 0;
+		if (q->byte < len) {
+			cb_byte_t c = ubytes[q->byte];
+			direction = (1 + (q->otherbits | c)) >> 8;
+			top = q;
+			tdirection = direction;
+		}
+		p = q;
+	}
+
+	leaf = cb_child_leaf(p, direction);
+	if (cb_get_keylen(leaf) < len || memcmp(cb_get_key(leaf), ubytes, len) != 0) {
+		return 0;
+	}
+	return cb_child_count(top->child[tdirection]);
+}
+
+/*! Returns the number of keys in tree less than str */
+size_t cb_tree_rank(cb_tree_t *tree, const char *str)
+{
+	return cb_tree_rank_n(tree, str, strlen(str));
+}
+
+/*! Returns the number of keys in tree less than the len bytes at key. With
+subtree counts, the keys left of the path to the insertion point of key
+are added up, like in cb_tree_neighbor_i(). */
+size_t cb_tree_rank_n(cb_tree_t *tree, const void *key, size_t len)
+{
+	const cb_byte_t *ubytes = (const cb_byte_t *)key;
+	const cb_leaf_t *leaf;
+	cb_keylen_t critbyte, critbits;
+	cb_node_t *p;
+	int direction, critdirection;
+	size_t rank = 0;
+
+	if (len > MAX_KEYLEN) {
+		/* ordered like in cb_tree_neighbor_i() */
+		return cb_tree_rank_n(tree, key, MAX_KEYLEN) +
+			(cb_tree_contains_n(tree, key, MAX_KEYLEN) != 0);
+	}
+	if (!tree->counted) {
+		cb_tree_walk_range_n(tree, "", 0, key, len, count_cb, &rank);
+		return rank;
+	}
+	if (tree->root == NULL) {
+		return 0;
+	}
+
+	p = tree->root;
+	direction = ROOT_DIRECTION;
+	while (IS_NODE(p->child[direction])) {
+		p = NODE(p->child[direction]);
+		direction = 0;
+		if (p->byte < len) {
+			cb_byte_t c = ubytes[p->byte];
+			direction = (1 + (p->otherbits | c)) >> 8;
+		}
+	}
+	leaf = cb_child_leaf(p, direction);
+	critdirection = cb_find_crit(cb_get_key(leaf), cb_get_keylen(leaf),
+		ubytes, len, &critbyte, &critbits);
+
+	p = tree->root;
+	direction = ROOT_DIRECTION;
+	while (IS_NODE(p->child[direction])) {
+		cb_node_t *q = NODE(p->child[direction]);
+		if (critbits != 0 && cb_crit_after(q, critbyte, critbits)) {
+			break;
+		}
+		direction = 0;
+		if (q->byte < len) {
+			cb_byte_t c = ubytes[q->byte];
+			direction = (1 + (q->otherbits | c)) >> 8;
+		}
+		if (direction == 1) {
+			rank += cb_child_count(q->child[0]);
+		}
+		p = q;
+	}
+
+	if (critbits != 0 && critdirection == 0) {
+		/* the whole subtree is less than key */
+		rank += cb_child_count(p->child[direction]);
+	}
+	return rank;
+}
+
+/*! Returns the key with the given rank, or NULL */
+const void *cb_tree_select(cb_tree_t *tree, size_t rank, size_t *foundlen)
+{
+	cb_node_t *p;
+	int direction;
+
+	if (!tree->counted) {
+		cb_cursor_t cursor = cb_cursor_make(tree);
+		const void *key = NULL;
+		int res;
+		for (res = cb_cursor_first(&cursor); res == 0 && rank > 0; rank--) {
+			res = cb_cursor_next(&cursor);
+		}
+		if (res == 0) {
+			key = cb_cursor_key(&cursor, foundlen);
+		}
+		cb_cursor_free(&cursor);
+		return key;
+	}
+	if (tree->root == NULL || rank >= COUNT(tree->root)) {
+		return NULL;
+	}
+
+	p = tree->root;
+	direction = ROOT_DIRECTION;
+	while (IS_NODE(p->child[direction])) {
+		size_t left;
+		p = NODE(p->child[direction]);
+		left = cb_child_count(p->child[0]);
+		direction = 0;
+		if (rank >= left) {
+			rank -= left;
+			direction = 1;
+		}
+	}
+	return cb_found_key(cb_child_leaf(p, direction), foundlen);
+}
+
+/*
+Cursors keep the nodes where the path to the current key turned left: the
+next key is the leftmost one in the right subtree of the deepest of them.
+The stack starts in the cursor itself, so that making one allocates
+nothing; only deeper trees move it to the heap. The tree allocator is not
+used, as it may be an arena that never frees single blocks.
+*/
+#define CURSOR_STACK(c) ((c)->stack != NULL ? (c)->stack : (c)->fixed)
+
+static int cb_cursor_push(cb_cursor_t *cursor, cb_node_t *node)
+{
+	if (cursor->depth == cursor->capacity) {
+		size_t capacity = 2 * cursor->capacity;
+		cb_node_t **stack = (cb_node_t **)malloc(capacity * sizeof(cb_node_t *));
+		if (stack == NULL) {
+			cursor->node = NULL;
+			return ENOMEM;
+		}
+		memcpy(stack, CURSOR_STACK(cursor), cursor->depth * sizeof(cb_node_t *));
+		free(cursor->stack);
+		cursor->stack = stack;
+		cursor->capacity = capacity;
+	}
+	CURSOR_STACK(cursor)[cursor->depth++] = node;
+	return 0;
+}
+
+/* Moves the cursor to the leftmost key below the child of par */
+static int cb_cursor_descend(cb_cursor_t *cursor, cb_node_t *par, int dir)
+{
+	while (IS_NODE(par->child[dir])) {
+		par = NODE(par->child[dir]);
+		dir = 0;
+		if (cb_cursor_push(cursor, par) != 0) {
+			return ENOMEM;
+		}
+	}
+	cursor->node = par;
+	cursor->dir = dir;
+	return 0;
+}
+
+/*! Creates a cursor for tree, not positioned on any key */
+cb_cursor_t cb_cursor_make(cb_tree_t *tree)
+{
+	cb_cursor_t cursor;
+	cursor.tree = tree;
+	cursor.node = NULL;
+	cursor.dir = 0;
+	cursor.stack = NULL;
+	cursor.depth = 0;
+	cursor.capacity = CB_CURSOR_DEPTH;
+	return cursor;
+}
+
+/*! Moves the cursor to the smallest key */
+int cb_cursor_first(cb_cursor_t *cursor)
+{
+	cursor->node = NULL;
+	cursor->depth = 0;
+	if (cursor->tree->root == NULL) {
+		return 1;
+	}
+	return cb_cursor_descend(cursor, cursor->tree->root, ROOT_DIRECTION);
+}
+
+/*! Moves the cursor to the next key */
+int cb_cursor_next(cb_cursor_t *cursor)
+{
+	if (cursor->depth == 0) {
+		cursor->node = NULL;
+		return 1;
+	}
+	return cb_cursor_descend(cursor, CURSOR_STACK(cursor)[--cursor->depth], 1);
+}
+
+/*! Moves the cursor to the smallest key not less than str */
+int cb_cursor_seek(cb_cursor_t *cursor, const char *str)
+{
+	return cb_cursor_seek_n(cursor, str, strlen(str));
+}
+
+/*! Moves the cursor to the smallest key not less than the len bytes at key */
+int cb_cursor_seek_n(cb_cursor_t *cursor, const void *key, size_t len)
+{
+	const cb_byte_t *ubytes = (const cb_byte_t *)key;
+	const cb_leaf_t *leaf;
+	cb_keylen_t critbyte, critbits;
+	cb_node_t *p;
+	int direction, critdirection;
+
+	cursor->node = NULL;
+	cursor->depth = 0;
+	if (cursor->tree->root == NULL) {
+		return 1;
+	}
+	if (len > MAX_KEYLEN) {
+		/* ordered like in cb_tree_neighbor_i() */
+		int res = cb_cursor_seek_n(cursor, key, MAX_KEYLEN);
+		const void *found = cb_cursor_key(cursor, &len);
+		if (found != NULL && len == MAX_KEYLEN && memcmp(found, key, len) == 0) {
+			res = cb_cursor_next(cursor);
+		}
+		return res;
+	}
+
+	/* Find the critical bit between the key and its best match */
+	p = cursor->tree->root;
+	direction = ROOT_DIRECTION;
+	while (IS_NODE(p->child[direction])) {
+		p = NODE(p->child[direction]);
+		direction = 0;
+		if (p->byte < len) {
+			cb_byte_t c = ubytes[p->byte];
+			direction = (1 + (p->otherbits | c)) >> 8;
+		}
+	}
+	leaf = cb_child_leaf(p, direction);
+	critdirection = cb_find_crit(cb_get_key(leaf), cb_get_keylen(leaf),
+		ubytes, len, &critbyte, &critbits);
+
+	/* Walk down again to where the key would be inserted. All keys in the
+	subtree found there are on the same side of it. */
+	p = cursor->tree->root;
+	direction = ROOT_DIRECTION;
+	while (IS_NODE(p->child[direction])) {
+		cb_node_t *q = NODE(p->child[direction]);
+		if (critbits != 0 && cb_crit_after(q, critbyte, critbits)) {
+			break;
+		}
+		direction = 0;
+		if (q->byte < len) {
+			cb_byte_t c = ubytes[q->byte];
+			direction = (1 + (q->otherbits | c)) >> 8;
+		}
+		if (direction == 0 && cb_cursor_push(cursor, q) != 0) {
+			return ENOMEM;
+		}
+		p = q;
+	}
+
+	if (critbits == 0 || critdirection == 1) {
+		return cb_cursor_descend(cursor, p, direction);
+	}
+	return cb_cursor_next(cursor);
+}
+
+/*! Returns the current key and stores its length in len */
+const void *cb_cursor_key(const cb_cursor_t *cursor, size_t *len)
+{
+	const cb_leaf_t *leaf;
+	if (cursor->node == NULL) {
+		return NULL;
+	}
+	leaf = cb_child_leaf(cursor->node, cursor->dir);
+	*len = cb_get_keylen(leaf);
+	return cb_get_key(leaf);
+}
+
+/*! Frees the cursor stack, if it was allocated */
+void cb_cursor_free(cb_cursor_t *cursor)
+{
+	free(cursor->stack);
+	cursor->node = NULL;
+	cursor->stack = NULL;
+	cursor->depth = 0;
+	cursor->capacity = CB_CURSOR_DEPTH;
+}
+
+/* Compares two keys like memcmp(), with prefixes first */
+static int cb_key_compare(const void *a, size_t alen, const void *b, size_t blen)
+{
+	int res = memcmp(a, b, alen < blen ? alen : blen);
+	if (res != 0) {
+		return res;
+	}
+	return alen < blen ? -1 : alen > blen;
+}
+
+/*! Calls callback for all strings in tree from lo up to hi */
+int cb_tree_walk_range(cb_tree_t *tree, const char *lo, const char *hi,
+	int (*callback)(const char *, void *), void *baton)
+{
+	struct callback_str param;
+	param.callback = callback;
 	param.baton = baton;
-	return cb_tree_walk_prefixed_i(tree, (const cb_byte_t*)prefix,
-	  strlen(prefix), callback_str_wrapper, &param);
+	return cb_tree_walk_range_n(tree, lo, strlen(lo), hi,
+		hi ? strlen(hi) : 0, callback_str_wrapper, &param);
+}
+
+/*! Calls callback for all keys in tree from the lolen bytes at lo up to
+the hilen bytes at hi. The cursor seek only visits the path to lo, and
+each step to the next key is amortized constant time. The cursor lives on
+the stack, and only allocates for trees deeper than CB_CURSOR_DEPTH. */
+int cb_tree_walk_range_n(cb_tree_t *tree, const void *lo, size_t lolen,
+	const void *hi, size_t hilen,
+	int (*callback)(const void *, size_t, void *), void *baton)
+{
+	cb_cursor_t cursor = cb_cursor_make(tree);
+	int res, ret = 0;
+
+	for (res = cb_cursor_seek_n(&cursor, lo, lolen); res == 0;
+			res = cb_cursor_next(&cursor)) {
+		size_t len = 0;
+		const void *key = cb_cursor_key(&cursor, &len);
+		if (hi != NULL && cb_key_compare(key, len, hi, hilen) >= 0) {
+			break;
+		}
+		ret = (callback)(key, len, baton);
+		if (ret != 0) {
+			break;
+		}
+	}
+
+	cb_cursor_free(&cursor);
+	return res == ENOMEM ? ENOMEM : ret;
+}
+
+/* Returns the shard holding the len bytes at key. Only the first byte is
+used, so that the shards stay in key order; see cb_sharded_init(). */
+static cb_shard_t *cb_shard_of(cb_sharded_t *sharded, const void *key, size_t len)
+{
+	if (len == 0) {
+		return &sharded->shards[0];
+	}
+	return &sharded->shards[sharded->shard_of[*(const cb_byte_t *)key]];
+}
+
+static void cb_shard_lock(cb_sharded_t *sharded, cb_shard_t *shard)
+{
+	if (sharded->lock != NULL && shard->lock != NULL) {
+		sharded->lock(shard->lock);
+	}
+}
+
+static void cb_shard_unlock(cb_sharded_t *sharded, cb_shard_t *shard)
+{
+	if (sharded->unlock != NULL && shard->lock != NULL) {
+		sharded->unlock(shard->lock);
+	}
+}
+
+/*! Splits the keyspace into nshards trees by the first byte of keys */
+int cb_sharded_init(cb_sharded_t *sharded, size_t nshards, int first, int last)
+{
+	size_t i;
+
+	if (nshards == 0 || nshards > 256 || first < 0 || last > 255 || first > last) {
+		return EINVAL;
+	}
+	sharded->shards = (cb_shard_t *)malloc(nshards * sizeof(cb_shard_t));
+	if (sharded->shards == NULL) {
+		return ENOMEM;
+	}
+	for (i = 0; i < nshards; i++) {
+		sharded->shards[i].tree = cb_tree_make();
+		sharded->shards[i].lock = NULL;
+	}
+	sharded->nshards = nshards;
+	for (i = 0; i < 256; i++) {
+		if ((int)i < first) {
+			sharded->shard_of[i] = 0;
+		}
+		else if ((int)i > last) {
+			sharded->shard_of[i] = (unsigned char)(nshards - 1);
+		}
+		else {
+			sharded->shard_of[i] = (unsigned char)
+				((i - first) * nshards / (last - first + 1));
+		}
+	}
+	sharded->lock = NULL;
+	sharded->unlock = NULL;
+	return 0;
+}
+
+/*! Returns non-zero if sharded contains str */
+int cb_sharded_contains(cb_sharded_t *sharded, const char *str)
+{
+	return cb_sharded_contains_n(sharded, str, strlen(str));
+}
+
+/*! Returns non-zero if sharded contains the len bytes at key */
+int cb_sharded_contains_n(cb_sharded_t *sharded, const void *key, size_t len)
+{
+	cb_shard_t *shard = cb_shard_of(sharded, key, len);
+	int res;
+	cb_shard_lock(sharded, shard);
+	res = cb_tree_contains_n(&shard->tree, key, len);
+	cb_shard_unlock(sharded, shard);
+	return res;
+}
+
+/*! Inserts str into sharded, returns 0 on success */
+int cb_sharded_insert(cb_sharded_t *sharded, const char *str)
+{
+	return cb_sharded_insert_n(sharded, str, strlen(str));
+}
+
+/*! Inserts the len bytes at key into sharded, returns 0 on success */
+int cb_sharded_insert_n(cb_sharded_t *sharded, const void *key, size_t len)
+{
+	cb_shard_t *shard = cb_shard_of(sharded, key, len);
+	int res;
+	cb_shard_lock(sharded, shard);
+	res = cb_tree_insert_n(&shard->tree, key, len);
+	cb_shard_unlock(sharded, shard);
+	return res;
+}
+
+/*! Deletes str from sharded, returns 0 on success */
+int cb_sharded_delete(cb_sharded_t *sharded, const char *str)
+{
+	return cb_sharded_delete_n(sharded, str, strlen(str));
+}
+
+/*! Deletes the len bytes at key from sharded, returns 0 on success */
+int cb_sharded_delete_n(cb_sharded_t *sharded, const void *key, size_t len)
+{
+	cb_shard_t *shard = cb_shard_of(sharded, key, len);
+	int res;
+	cb_shard_lock(sharded, shard);
+	res = cb_tree_delete_n(&shard->tree, key, len);
+	cb_shard_unlock(sharded, shard);
+	return res;
+}
+
+/*! Calls callback for all strings in sharded with the given prefix */
+int cb_sharded_walk_prefixed(cb_sharded_t *sharded, const char *prefix,
+	int (*callback)(const char *, void *), void *baton)
+{
+	struct callback_str param;
+	param.callback = callback;
+	param.baton = baton;
+	return cb_sharded_walk_prefixed_n(sharded, prefix, strlen(prefix),
+		callback_str_wrapper, &param);
+}
+
+/*! Calls callback for all keys in sharded starting with the len bytes at
+prefix, in order. A non-empty prefix only needs its own shard. */
+int cb_sharded_walk_prefixed_n(cb_sharded_t *sharded, const void *prefix,
+	size_t len, int (*callback)(const void *, size_t, void *), void *baton)
+{
+	size_t i = 0, end = sharded->nshards;
+	int res = 0;
+
+	if (len > 0) {
+		i = cb_shard_of(sharded, prefix, len) - sharded->shards;
+		end = i + 1;
+	}
+	for (; i < end && res == 0; i++) {
+		cb_shard_t *shard = &sharded->shards[i];
+		cb_shard_lock(sharded, shard);
+		res = cb_tree_walk_prefixed_n(&shard->tree, prefix, len, callback, baton);
+		cb_shard_unlock(sharded, shard);
+	}
+	return res;
+}
+
+/*! Clears all shards */
+void cb_sharded_clear(cb_sharded_t *sharded)
+{
+	size_t i;
+	for (i = 0; i < sharded->nshards; i++) {
+		cb_tree_clear(&sharded->shards[i].tree);
+	}
+}
+
+/*! Clears all shards and frees them */
+void cb_sharded_free(cb_sharded_t *sharded)
+{
+	cb_sharded_clear(sharded);
+	free(sharded->shards);
+	sharded->shards = NULL;
+	sharded->nshards = 0;
+}
+
+/* Moves the cursor to the first key of the shards from the given one on */
+static int cb_sharded_cursor_from(cb_sharded_cursor_t *cursor, size_t shard)
+{
+	int res = 1;
+	for (; shard < cursor->sharded->nshards && res == 1; shard++) {
+		cb_cursor_free(&cursor->cursor);
+		cursor->shard = shard;
+		cursor->cursor = cb_cursor_make(&cursor->sharded->shards[shard].tree);
+		res = cb_cursor_first(&cursor->cursor);
+	}
+	return res;
+}
+
+/*! Creates a cursor for sharded, not positioned on any key */
+cb_sharded_cursor_t cb_sharded_cursor_make(cb_sharded_t *sharded)
+{
+	cb_sharded_cursor_t cursor;
+	cursor.sharded = sharded;
+	cursor.shard = 0;
+	cursor.cursor = cb_cursor_make(&sharded->shards[0].tree);
+	return cursor;
+}
+
+/*! Moves the cursor to the smallest key */
+int cb_sharded_cursor_first(cb_sharded_cursor_t *cursor)
+{
+	return cb_sharded_cursor_from(cursor, 0);
+}
+
+/*! Moves the cursor to the next key, going on with the next shards */
+int cb_sharded_cursor_next(cb_sharded_cursor_t *cursor)
+{
+	int res = cb_cursor_next(&cursor->cursor);
+	if (res == 1) {
+		res = cb_sharded_cursor_from(cursor, cursor->shard + 1);
+	}
+	return res;
+}
+
+/*! Moves the cursor to the smallest key not less than str */
+int cb_sharded_cursor_seek(cb_sharded_cursor_t *cursor, const char *str)
+{
+	return cb_sharded_cursor_seek_n(cursor, str, strlen(str));
+}
+
+/*! Moves the cursor to the smallest key not less than the len bytes at
+key, which is in the shard of the key or one of the following ones */
+int cb_sharded_cursor_seek_n(cb_sharded_cursor_t *cursor, const void *key,
+	size_t len)
+{
+	cb_shard_t *shard = cb_shard_of(cursor->sharded, key, len);
+	int res;
+
+	cb_cursor_free(&cursor->cursor);
+	cursor->shard = shard - cursor->sharded->shards;
+	cursor->cursor = cb_cursor_make(&shard->tree);
+	res = cb_cursor_seek_n(&cursor->cursor, key, len);
+	if (res == 1) {
+		res = cb_sharded_cursor_from(cursor, cursor->shard + 1);
+	}
+	return res;
+}
+
+/*! Returns the current key and stores its length in len */
+const void *cb_sharded_cursor_key(const cb_sharded_cursor_t *cursor,
+	size_t *len)
+{
+	return cb_cursor_key(&cursor->cursor, len);
 }
 
+/*! Frees the cursor stack, if it was allocated */
+void cb_sharded_cursor_free(cb_sharded_cursor_t *cursor)
+{
+	cb_cursor_free(&cursor->cursor);
+}
@@ -13,26 +13,276 @@
 extern "C" {
 #endif
 
-/*! Main data structure */
+/*! Main data structure. Every block is allocated by malloc() and
+ * released by free() (or all at once by clear(), if set). Keys are at
+ * most INT_MAX bytes long: inserting longer keys fails with EINVAL, and
+ * they are never found, but ordered queries place them correctly among
+ * the keys of the tree. */
 typedef struct {
 	struct cb_node_t * root;
+	int counted; /*! Non-zero if nodes keep subtree counts */
+	int concurrent; /*! Non-zero if insertions may run concurrently */
+	int persistent; /*! Non-zero if versions share nodes */
 	void *(*malloc)(size_t size, void *baton);
 	void (*free)(void *ptr, void *baton);
-	void *baton; /*! Passed to malloc() and free() */
+	void (*clear)(void *baton); /*! Optional, frees all blocks at once */
+	void (*retire)(void *ptr, void *baton); /*! See cb_tree_use_rcu() */
+	void *baton; /*! Passed to malloc(), free(), clear() and retire() */
+	unsigned long seq; /*! Odd while a deletion relocates a node */
 } cb_tree_t;
 
+/*! Number of block size classes recycled by cb_tree_use_pool() */
+#define CB_POOL_CLASSES 32
+
+/*! Arena allocator, see cb_tree_use_arena() and cb_tree_use_pool() */
+typedef struct {
+	void *chunks;
+	char *next;
+	size_t left;
+	size_t chunk_size;
+	void *free_lists[CB_POOL_CLASSES];
+	void *large;
+	size_t hits; /*! Pool allocations served from the free lists */
+	size_t misses; /*! Pool allocations carved from the chunks */
+} cb_arena_t;
+
+/*! Read-side state of a thread using a cb_epoch_t */
+typedef struct cb_epoch_reader_t {
+	unsigned long epoch; /*! Epoch entered in, zero outside of sections */
+	struct cb_epoch_reader_t *next;
+} cb_epoch_reader_t;
+
+/*! Epoch-based reclamation of blocks deleted from a tree in RCU mode, see
+ * cb_tree_use_epoch() */
+typedef struct {
+	unsigned long epoch;
+	cb_epoch_reader_t *readers;
+	struct cb_retired_t *retired; /*! Blocks waiting for the readers */
+	size_t size;
+	size_t capacity;
+	size_t pending; /*! Blocks retired since the last reclamation */
+	void *(*malloc)(size_t size, void *baton); /*! Hooks of the tree */
+	void (*free)(void *ptr, void *baton);
+	void (*clear)(void *baton);
+	void *baton;
+} cb_epoch_t;
+
+/*! Depth of the stack embedded in cursors */
+#define CB_CURSOR_DEPTH 64
+
+/*! In-order iterator over the keys of a tree. The tree must not be
+ * modified while a cursor is positioned on it. The cursor never uses the
+ * allocator of the tree: its stack is embedded, and only trees deeper
+ * than CB_CURSOR_DEPTH make it move to a stack allocated by malloc().
+ * A cursor must not be copied once it has been used, as the copies would
+ * share that stack. */
+typedef struct {
+	cb_tree_t *tree;
+	struct cb_node_t *node; /*! Parent of the current key, NULL if none */
+	int dir;
+	struct cb_node_t **stack; /*! Nodes whose right subtree is pending,
+	                           * NULL while they fit in fixed */
+	size_t depth;
+	size_t capacity;
+	struct cb_node_t *fixed[CB_CURSOR_DEPTH];
+} cb_cursor_t;
+
+/*! Shard of a cb_sharded_t */
+typedef struct {
+	cb_tree_t tree;
+	void *lock; /*! Passed to the lock hooks, NULL for no locking */
+} cb_shard_t;
+
+/*! Keys split by their first byte over independent trees, each with its
+ * own lock, so that threads modifying different shards do not contend.
+ * Every shard holds a range of first bytes, so the shards in order hold
+ * the keys in order. See cb_sharded_init() for the limits of this split. */
+typedef struct {
+	cb_shard_t *shards;
+	size_t nshards;
+	unsigned char shard_of[256]; /*! Shard of each first byte, nondecreasing */
+	void (*lock)(void *lock); /*! Optional, called with the lock of a shard */
+	void (*unlock)(void *lock);
+} cb_sharded_t;
+
+/*! In-order iterator over the keys of all shards of a cb_sharded_t */
+typedef struct {
+	cb_sharded_t *sharded;
+	size_t shard; /*! Shard of the current key */
+	cb_cursor_t cursor;
+} cb_sharded_cursor_t;
+
 /*! Creates an new, empty critbit tree */
 extern cb_tree_t cb_tree_make();
 
+/*! Creates an new, empty arena with the given chunk size (0 for default) */
+extern cb_arena_t cb_arena_make(size_t chunk_size);
+
+/*! Frees all memory allocated from the arena */
+extern void cb_arena_clear(cb_arena_t *arena);
+
+/*! Makes an empty tree allocate its keys from arena, which must not be
+ * shared with other trees. Deleted keys are not reused, but clearing the
+ * tree only frees the arena chunks instead of walking all nodes. */
+extern void cb_tree_use_arena(cb_tree_t *tree, cb_arena_t *arena);
+
+/*! Like cb_tree_use_arena(), but deleted blocks are put on free lists by
+ * size class and reused by later insertions, at the cost of a small header
+ * per block. */
+extern void cb_tree_use_pool(cb_tree_t *tree, cb_arena_t *arena);
+
+/*! Makes tree safe for lookups with cb_tree_contains() and cb_tree_get()
+ * from any number of threads, while a single thread at a time modifies it.
+ * Blocks unlinked by deletions are passed to retire() instead of free();
+ * it must free them once all lookups running at the time have finished.
+ * Returns 0 on success, or EINVAL if the tree is persistent, as its
+ * copied paths are not published safely. Requires a compiler with
+ * GCC-style atomic builtins. */
+extern int cb_tree_use_rcu(cb_tree_t *tree,
+	void (*retire)(void *ptr, void *baton));
+
+/*! Creates a new epoch manager without readers */
+extern cb_epoch_t cb_epoch_make();
+
+/*! Puts tree in RCU mode (see cb_tree_use_rcu()) with blocks unlinked by
+ * deletions freed by epoch once no reader can reach them. Set up any
+ * allocator of tree before, as epoch wraps its hooks; clearing the tree
+ * requires that no reader is active. Retired blocks are reclaimed every
+ * few deletions, or explicitly with cb_epoch_reclaim(). Returns 0 on
+ * success, or EINVAL if the tree is persistent, like cb_tree_use_rcu(). */
+extern int cb_tree_use_epoch(cb_tree_t *tree, cb_epoch_t *epoch);
+
+/*! Adds reader to the readers of epoch. Each thread looking up keys needs
+ * its own reader, which must remain valid as long as epoch is used, but
+ * may be handed over to another thread. */
+extern void cb_epoch_register(cb_epoch_t *epoch, cb_epoch_reader_t *reader);
+
+/*! Starts a section in which the thread owning reader may look up keys
+ * and use the keys and values found */
+extern void cb_epoch_enter(cb_epoch_t *epoch, cb_epoch_reader_t *reader);
+
+/*! Ends a section started by cb_epoch_enter() */
+extern void cb_epoch_exit(cb_epoch_reader_t *reader);
+
+/*! Frees the retired blocks that no active reader can reach. Like the
+ * other functions below, may only be called by the writer. */
+extern void cb_epoch_reclaim(cb_epoch_t *epoch);
+
+/*! Waits until all readers active at the time of the call have exited,
+ * then frees all retired blocks. Call this before releasing epoch. */
+extern void cb_epoch_synchronize(cb_epoch_t *epoch);
+
+/*! Lets any number of threads insert keys into tree at the same time, and
+ * look them up with cb_tree_contains() and cb_tree_get(). Each insertion
+ * links its key with a compare-and-swap on a single child pointer, and
+ * starts over if another insertion changed it first. The allocator of the
+ * tree must be thread-safe, and other modifications, such as deletions,
+ * must not run concurrently with insertions. Passing on = 0 leaves this
+ * mode once all concurrent insertions are done. Returns 0 on success, or
+ * EINVAL if the tree uses subtree counts or is persistent. Requires a
+ * compiler with GCC-style atomic builtins. */
+extern int cb_tree_use_concurrent_insert(cb_tree_t *tree, int on);
+
+/*! Makes an empty tree persistent: modifications copy the nodes shared
+ * with snapshots of the tree instead of changing them, so that each
+ * snapshot keeps the keys it had when it was taken. Nodes and keys are
+ * reference-counted and freed with the last version using them; the block
+ * of a deleted key stays allocated while its node is in use. Insertions
+ * and deletions may return ENOMEM when a copy cannot be allocated, leaving
+ * the tree unchanged. Value slots are shared between versions. Cannot be
+ * combined with the other modes or with cb_tree_build_sorted(), and
+ * cb_tree_clear() never uses the clear() hook. Returns 0 on success, or
+ * EINVAL if the tree is not empty or another mode is on. */
+extern int cb_tree_use_persistent(cb_tree_t *tree);
+
+/*! Returns a snapshot of a persistent tree in constant time. It is a tree
+ * of its own, sharing the nodes of tree, which can be read and modified
+ * independently, and must be released with cb_tree_clear(). Taking a
+ * snapshot must not run concurrently with modifications of tree, but other
+ * threads can read and release their snapshots at any time, if the
+ * allocator is thread-safe. Returns a new, empty tree if tree is not
+ * persistent. */
+extern cb_tree_t cb_tree_snapshot(cb_tree_t *tree);
+
+/*! Makes an empty tree keep the number of keys below each node, at the
+ * cost of a word per key, so that cb_tree_count_prefixed(), cb_tree_rank()
+ * and cb_tree_select() take time proportional to the tree depth instead of
+ * the number of keys. Returns 0 on success, or EINVAL if the tree is not
+ * empty, is persistent or uses concurrent insertion. */
+extern int cb_tree_use_counts(cb_tree_t *tree);
+
 /*! Returns non-zero if tree contains str */
 extern int cb_tree_contains(cb_tree_t *tree, const char *str);
 
+/*! Returns non-zero if tree contains the len bytes at key */
+extern int cb_tree_contains_n(cb_tree_t *tree, const void *key, size_t len);
+
+/*! Looks up n keys at once, setting results[i] to non-zero if the tree
+ * contains the lens[i] bytes at keys[i]. If lens is NULL, the keys are
+ * strings. Returns the number of keys found. Several lookups are kept in
+ * flight, so this is faster than looping over cb_tree_contains_n() on
+ * trees that do not fit in the cache. */
+extern size_t cb_tree_contains_batch(cb_tree_t *tree, const void *const *keys,
+	const size_t *lens, size_t n, int *results);
+
 /*! Inserts str into tree, returns 0 on suceess */
 extern int cb_tree_insert(cb_tree_t *tree, const char *str);
 
+/*! Inserts the len bytes at key into tree, returns 0 on success */
+extern int cb_tree_insert_n(cb_tree_t *tree, const void *key, size_t len);
+
+/*! Inserts str into tree together with a value slot of valsize bytes,
+ * allocated in the same block as the key. On success, returns 0 and stores
+ * the address of the uninitialized slot in *value. If str is already in the
+ * tree, returns 1 and stores the address of its existing slot instead. */
+extern int cb_tree_insert_value(cb_tree_t *tree, const char *str,
+	size_t valsize, void **value);
+
+/*! Like cb_tree_insert_value(), for the len bytes at key */
+extern int cb_tree_insert_value_n(cb_tree_t *tree, const void *key,
+	size_t len, size_t valsize, void **value);
+
+/*! Inserts str into tree without copying it: the tree only keeps the
+ * pointer, so str must remain valid and unchanged while it is in the tree.
+ * Returns 0 on success. */
+extern int cb_tree_insert_ref(cb_tree_t *tree, const char *str);
+
+/*! Like cb_tree_insert_ref(), for the len bytes at key */
+extern int cb_tree_insert_ref_n(cb_tree_t *tree, const void *key, size_t len);
+
+/*! Like cb_tree_insert_value_n(), without copying the key */
+extern int cb_tree_insert_value_ref_n(cb_tree_t *tree, const void *key,
+	size_t len, size_t valsize, void **value);
+
+/*! Inserts n keys into tree, where keys[i] has lens[i] bytes (or is a
+ * string, if lens is NULL), skipping keys already in tree, and stores the
+ * number of keys inserted in inserted. Each search resumes from the path
+ * of the previous key where they share a prefix, so this is fastest for
+ * sorted or clustered keys. Returns 0 on success, or EINVAL or ENOMEM
+ * (after inserting the keys before the failing one). */
+extern int cb_tree_insert_batch(cb_tree_t *tree, const void *const *keys,
+	const size_t *lens, size_t n, size_t *inserted);
+
+/*! Builds an empty tree from n keys in strictly increasing order, where
+ * keys[i] has lens[i] bytes (or is a string, if lens is NULL), in linear
+ * time. Returns 0 on success, EINVAL if the tree is not empty or the keys
+ * are not sorted, or ENOMEM (leaving the tree empty). */
+extern int cb_tree_build_sorted(cb_tree_t *tree, const void *const *keys,
+	const size_t *lens, size_t n);
+
+/*! Returns the value slot stored with str, or NULL if str is not in tree.
+ * Keys inserted without a value have an empty slot. */
+extern void *cb_tree_get(cb_tree_t *tree, const char *str);
+
+/*! Like cb_tree_get(), for the len bytes at key */
+extern void *cb_tree_get_n(cb_tree_t *tree, const void *key, size_t len);
+
 /*! Deletes str from the tree, returns 0 on suceess */
 extern int cb_tree_delete(cb_tree_t *tree, const char *str);
 
+/*! Deletes the len bytes at key from the tree, returns 0 on success */
+extern int cb_tree_delete_n(cb_tree_t *tree, const void *key, size_t len);
+
 /*! Clears the given tree */
 extern void cb_tree_clear(cb_tree_t *tree);
 
@@ -40,6 +290,184 @@ extern void cb_tree_clear(cb_tree_t *tree);
 extern int cb_tree_walk_prefixed(cb_tree_t *tree, const char *prefix,
 	int (*callback)(const char *, void *), void *baton);
 
+/*! Calls callback for all keys in tree starting with the len bytes at
+ * prefix. Keys may contain zero bytes, so their length is passed along;
+ * copied keys are still followed by a terminating zero byte. */
+extern int cb_tree_walk_prefixed_n(cb_tree_t *tree, const void *prefix,
+	size_t len, int (*callback)(const void *, size_t, void *), void *baton);
+
+/*! Returns the longest key in tree that is a prefix of str, or NULL */
+extern const char *cb_tree_longest_prefix(cb_tree_t *tree, const char *str);
+
+/*! Returns the longest key in tree that is a prefix of the len bytes at
+ * key, or NULL. The length of the returned key is stored in foundlen. */
+extern const void *cb_tree_longest_prefix_n(cb_tree_t *tree, const void *key,
+	size_t len, size_t *foundlen);
+
+/*! Returns the smallest key in tree not less than str, or NULL */
+extern const char *cb_tree_lower_bound(cb_tree_t *tree, const char *str);
+
+/*! Returns the smallest key in tree not less than the len bytes at key, or
+ * NULL. The length of the returned key is stored in foundlen. */
+extern const void *cb_tree_lower_bound_n(cb_tree_t *tree, const void *key,
+	size_t len, size_t *foundlen);
+
+/*! Returns the smallest key in tree greater than str (its upper bound),
+ * or NULL. str does not need to be in tree. */
+extern const char *cb_tree_successor(cb_tree_t *tree, const char *str);
+
+/*! Like cb_tree_successor(), for the len bytes at key */
+extern const void *cb_tree_successor_n(cb_tree_t *tree, const void *key,
+	size_t len, size_t *foundlen);
+
+/*! Returns the greatest key in tree less than str, or NULL. str does not
+ * need to be in tree. */
+extern const char *cb_tree_predecessor(cb_tree_t *tree, const char *str);
+
+/*! Like cb_tree_predecessor(), for the len bytes at key */
+extern const void *cb_tree_predecessor_n(cb_tree_t *tree, const void *key,
+	size_t len, size_t *foundlen);
+
+/*! Returns the number of strings in tree with the given prefix */
+extern size_t cb_tree_count_prefixed(cb_tree_t *tree, const char *prefix);
+
+/*! Returns the number of keys in tree starting with the len bytes at
+ * prefix */
+extern size_t cb_tree_count_prefixed_n(cb_tree_t *tree, const void *prefix,
+	size_t len);
+
+/*! Returns the number of keys in tree less than str */
+extern size_t cb_tree_rank(cb_tree_t *tree, const char *str);
+
+/*! Returns the number of keys in tree less than the len bytes at key */
+extern size_t cb_tree_rank_n(cb_tree_t *tree, const void *key, size_t len);
+
+/*! Returns the key with the given rank (the smallest key has rank 0), or
+ * NULL if rank is not less than the number of keys. The length of the
+ * returned key is stored in foundlen. */
+extern const void *cb_tree_select(cb_tree_t *tree, size_t rank,
+	size_t *foundlen);
+
+/*! Creates a cursor for tree, not positioned on any key */
+extern cb_cursor_t cb_cursor_make(cb_tree_t *tree);
+
+/*! Moves the cursor to the smallest key. Returns 0 on success, 1 if the
+ * tree is empty or ENOMEM if the cursor stack could not be grown. */
+extern int cb_cursor_first(cb_cursor_t *cursor);
+
+/*! Moves the cursor to the next key. Returns 0 on success, 1 if there
+ * are no more keys or ENOMEM. */
+extern int cb_cursor_next(cb_cursor_t *cursor);
+
+/*! Moves the cursor to the smallest key not less than str. Returns 0 on
+ * success, 1 if there is no such key or ENOMEM. */
+extern int cb_cursor_seek(cb_cursor_t *cursor, const char *str);
+
+/*! Like cb_cursor_seek(), for the len bytes at key */
+extern int cb_cursor_seek_n(cb_cursor_t *cursor, const void *key, size_t len);
+
+/*! Returns the current key and stores its length in len, or returns NULL
+ * if the cursor is not positioned on a key */
+extern const void *cb_cursor_key(const cb_cursor_t *cursor, size_t *len);
+
+/*! Frees the cursor stack, if it was allocated */
+extern void cb_cursor_free(cb_cursor_t *cursor);
+
+/*! Calls callback for all strings in tree from lo (inclusive) up to hi
+ * (exclusive) in order, or up to the last key if hi is NULL. Stops early
+ * and returns the callback result if it is non-zero, and returns ENOMEM
+ * if the walk could not allocate its stack, which only happens for trees
+ * deeper than CB_CURSOR_DEPTH. Callbacks that need to tell both apart
+ * must not return ENOMEM themselves. */
+extern int cb_tree_walk_range(cb_tree_t *tree, const char *lo, const char *hi,
+	int (*callback)(const char *, void *), void *baton);
+
+/*! Like cb_tree_walk_range(), for the lolen bytes at lo and the hilen
+ * bytes at hi */
+extern int cb_tree_walk_range_n(cb_tree_t *tree, const void *lo, size_t lolen,
+	const void *hi, size_t hilen,
+	int (*callback)(const void *, size_t, void *), void *baton);
+
+/*! Initializes sharded with nshards (at most 256) empty trees. Keys with
+ * first bytes from first to last are split evenly between the shards, the
+ * others go to the first or last shard, and the empty key to the first.
+ * The trees and locks of the shards can be set up before use. Returns 0
+ * on success, EINVAL or ENOMEM.
+ * Only the first byte picks the shard, which keeps the shards in order,
+ * but keys sharing a first byte always share a shard: with a common
+ * prefix, such as "http", all keys go to one shard and threads contend
+ * on its lock as with a single tree. At most one shard per distinct first
+ * byte is ever used. */
+extern int cb_sharded_init(cb_sharded_t *sharded, size_t nshards,
+	int first, int last);
+
+/*! Returns non-zero if sharded contains str */
+extern int cb_sharded_contains(cb_sharded_t *sharded, const char *str);
+
+/*! Returns non-zero if sharded contains the len bytes at key */
+extern int cb_sharded_contains_n(cb_sharded_t *sharded, const void *key,
+	size_t len);
+
+/*! Inserts str into its shard while holding its lock, returns 0 on
+ * success */
+extern int cb_sharded_insert(cb_sharded_t *sharded, const char *str);
+
+/*! Like cb_sharded_insert(), for the len bytes at key */
+extern int cb_sharded_insert_n(cb_sharded_t *sharded, const void *key,
+	size_t len);
+
+/*! Deletes str from its shard while holding its lock, returns 0 on
+ * success */
+extern int cb_sharded_delete(cb_sharded_t *sharded, const char *str);
+
+/*! Like cb_sharded_delete(), for the len bytes at key */
+extern int cb_sharded_delete_n(cb_sharded_t *sharded, const void *key,
+	size_t len);
+
+/*! Calls callback for all strings in sharded with the given prefix in
+ * order, holding the lock of each shard while walking it */
+extern int cb_sharded_walk_prefixed(cb_sharded_t *sharded, const char *prefix,
+	int (*callback)(const char *, void *), void *baton);
+
+/*! Like cb_sharded_walk_prefixed(), for the len bytes at prefix */
+extern int cb_sharded_walk_prefixed_n(cb_sharded_t *sharded,
+	const void *prefix, size_t len,
+	int (*callback)(const void *, size_t, void *), void *baton);
+
+/*! Clears all shards */
+extern void cb_sharded_clear(cb_sharded_t *sharded);
+
+/*! Clears all shards and frees them */
+extern void cb_sharded_free(cb_sharded_t *sharded);
+
+/*! Creates a cursor for sharded, not positioned on any key. Like with
+ * cb_cursor_t, the shards must not be modified while it is positioned. */
+extern cb_sharded_cursor_t cb_sharded_cursor_make(cb_sharded_t *sharded);
+
+/*! Moves the cursor to the smallest key of all shards, like
+ * cb_cursor_first() */
+extern int cb_sharded_cursor_first(cb_sharded_cursor_t *cursor);
+
+/*! Moves the cursor to the next key, like cb_cursor_next() */
+extern int cb_sharded_cursor_next(cb_sharded_cursor_t *cursor);
+
+/*! Moves the cursor to the smallest key not less than str, like
+ * cb_cursor_seek() */
+extern int cb_sharded_cursor_seek(cb_sharded_cursor_t *cursor,
+	const char *str);
+
+/*! Like cb_sharded_cursor_seek(), for the len bytes at key */
+extern int cb_sharded_cursor_seek_n(cb_sharded_cursor_t *cursor,
+	const void *key, size_t len);
+
+/*! Returns the current key and stores its length in len, or returns NULL
+ * if the cursor is not positioned on a key */
+extern const void *cb_sharded_cursor_key(const cb_sharded_cursor_t *cursor,
+	size_t *len);
+
+/*! Frees the cursor stack, if it was allocated */
+extern void cb_sharded_cursor_free(cb_sharded_cursor_t *cursor);
+
 /*! Prints tree nodes and leaves in ASCII art */
 extern void cb_tree_print(cb_tree_t *tree);
 
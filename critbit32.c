@@ -0,0 +1,509 @@
+/*
+ * critbit89 - A crit-bit tree implementation for strings in C89
+ * Written by Jonas Gehring <jonas@jgehring.net>
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "critbit32.h"
+
+/* Prefix nodes and the root sentinel work as in critbit.c */
+#define PREFIX_MASK 0xff
+#define ROOT_DIRECTION 1
+
+typedef unsigned char cb_byte_t;
+#if UINT_MAX >= 0xffffffffUL
+  typedef unsigned int cb32_index_t;
+#else
+  typedef unsigned long cb32_index_t;
+#endif
+
+/* The critical byte and its otherbits share a word, so nodes are three
+words without padding, at the cost of limiting keys to 16 MiB */
+typedef struct cb32_node_t {
+	cb32_index_t child[2];
+	cb32_index_t crit; /* byte << 8 | otherbits */
+} cb32_node_t;
+
+#define BYTE(q) ((size_t)((q)->crit >> 8))
+#define OTHERBITS(q) ((q)->crit & 0xff)
+#define MAX_KEYLEN ((size_t)0xffffff)
+
+/*
+A tree with n keys uses n nodes: the root sentinel and the n-1 inner
+nodes. Deleting a key frees its parent, and the last node is moved into
+the hole so that the array stays dense.
+Keys are appended to the key array as records of their length word, their
+bytes and a terminating zero, padded to a whole number of words; the array
+is compacted whenever it has to grow.
+Children are shifted left by one bit, which is set for leaves: the index
+of a node, or the offset of a key record in words, so that the key array
+can hold up to 8 GiB.
+*/
+#define IS_LEAF(child) (((child) & 1) != 0)
+#define INDEX(child) ((child) >> 1)
+#define NODE_CHILD(i) ((cb32_index_t)(i) << 1)
+#define LEAF_CHILD(i) (((cb32_index_t)(i) << 1) | 1)
+
+#define MAX_INDEX ((cb32_index_t)-1 >> 1)
+#define LEN_SIZE sizeof(cb32_index_t)
+#define RECORD_SIZE(len) ((2 * LEN_SIZE + (len)) / LEN_SIZE * LEN_SIZE)
+
+/* Size of the key array at which record offsets run out */
+#define MAX_KEYS_SIZE ((size_t)-1 / LEN_SIZE > MAX_INDEX ? \
+	((size_t)MAX_INDEX + 1) * LEN_SIZE : (size_t)-1 / LEN_SIZE * LEN_SIZE)
+
+/* Arrays grow by a quarter, trading some copying for less slack */
+#define GROW(n) ((n) + (n) / 4)
+
+/* Standard memory allocation functions */
+static void *malloc_std(size_t size, void *baton) {
+	(void)baton; /* Prevent compiler warnings */
+	return malloc(size);
+}
+
+static void free_std(void *ptr, void *baton) {
+	(void)baton; /* Prevent compiler warnings */
+	free(ptr);
+}
+
+/* Static helper functions */
+static const cb_byte_t *cb32_key(const cb32_tree_t *tree, size_t record)
+{
+	return (const cb_byte_t *)tree->keys + (record + 1) * LEN_SIZE;
+}
+
+static size_t cb32_keylen(const cb32_tree_t *tree, size_t record)
+{
+	return ((const cb32_index_t *)tree->keys)[record];
+}
+
+static int cb32_direction(const cb32_node_t *q, const cb_byte_t *ubytes,
+	size_t ulen)
+{
+	if (BYTE(q) < ulen) {
+		cb_byte_t c = ubytes[BYTE(q)];
+		return (1 + (OTHERBITS(q) | c)) >> 8;
+	}
+	return 0;
+}
+
+/* Makes room for one more node and a key of len bytes */
+static int cb32_reserve(cb32_tree_t *tree, size_t len)
+{
+	size_t live, capacity, i, used;
+	char *keys;
+
+	if (tree->size == tree->capacity) {
+		cb32_node_t *nodes;
+
+		capacity = tree->capacity ? GROW(tree->capacity) : 16;
+		if (capacity > MAX_INDEX + 1) {
+			capacity = MAX_INDEX + 1;
+		}
+		if (tree->size == capacity) {
+			return ENOMEM;
+		}
+
+		nodes = (cb32_node_t *)tree->malloc(capacity * sizeof(cb32_node_t), tree->baton);
+		if (nodes == NULL) {
+			return ENOMEM;
+		}
+		if (tree->size > 0) {
+			memcpy(nodes, tree->nodes, tree->size * sizeof(cb32_node_t));
+			tree->free(tree->nodes, tree->baton);
+		}
+		tree->nodes = nodes;
+		tree->capacity = capacity;
+	}
+
+	if (tree->keys_capacity - tree->keys_used >= RECORD_SIZE(len)) {
+		return 0;
+	}
+
+	/* Copy the live keys to a new array with a quarter more space */
+	live = tree->keys_used - tree->keys_garbage;
+	if (RECORD_SIZE(len) > MAX_KEYS_SIZE - live) {
+		return ENOMEM;
+	}
+	capacity = GROW(live + RECORD_SIZE(len));
+	if (capacity < live || capacity > MAX_KEYS_SIZE) {
+		capacity = MAX_KEYS_SIZE;
+	}
+	keys = (char *)tree->malloc(capacity, tree->baton);
+	if (keys == NULL) {
+		return ENOMEM;
+	}
+
+	/* Every key is the leaf child of exactly one node */
+	used = 0;
+	for (i = 0; i < tree->size; i++) {
+		int dir;
+		for (dir = 0; dir < 2; dir++) {
+			cb32_index_t child = tree->nodes[i].child[dir];
+			if (IS_LEAF(child)) {
+				size_t size = RECORD_SIZE(cb32_keylen(tree, INDEX(child)));
+				memcpy(keys + used, tree->keys + INDEX(child) * LEN_SIZE, size);
+				tree->nodes[i].child[dir] = LEAF_CHILD(used / LEN_SIZE);
+				used += size;
+			}
+		}
+	}
+	if (tree->keys != NULL) {
+		tree->free(tree->keys, tree->baton);
+	}
+	tree->keys = keys;
+	tree->keys_used = used;
+	tree->keys_capacity = capacity;
+	tree->keys_garbage = 0;
+	return 0;
+}
+
+/* Moves the node with index from to the unused index to */
+static void cb32_move_node(cb32_tree_t *tree, size_t from, size_t to)
+{
+	cb32_node_t *nodes = tree->nodes;
+	const cb_byte_t *ubytes;
+	size_t ulen, t, record;
+	cb32_index_t child;
+	int tdirection;
+
+	nodes[to] = nodes[from];
+	if (tree->root == from) {
+		tree->root = to;
+		return;
+	}
+
+	/* Any key below the node leads to it from the root */
+	child = nodes[from].child[0];
+	while (!IS_LEAF(child)) {
+		child = nodes[INDEX(child)].child[0];
+	}
+	record = INDEX(child);
+	ubytes = cb32_key(tree, record);
+	ulen = cb32_keylen(tree, record);
+
+	t = tree->root;
+	tdirection = ROOT_DIRECTION;
+	while (nodes[t].child[tdirection] != NODE_CHILD(from)) {
+		t = INDEX(nodes[t].child[tdirection]);
+		tdirection = cb32_direction(&nodes[t], ubytes, ulen);
+	}
+	nodes[t].child[tdirection] = NODE_CHILD(to);
+}
+
+static int cbt32_traverse_prefixed(cb32_tree_t *tree, size_t par, int dir,
+	int (*callback)(const void *, size_t, void *), void *baton)
+{
+	cb32_index_t child = tree->nodes[par].child[dir];
+
+	if (!IS_LEAF(child)) {
+		int ret = 0;
+
+		ret = cbt32_traverse_prefixed(tree, INDEX(child), 0, callback, baton);
+		if (ret != 0) {
+			return ret;
+		}
+		ret = cbt32_traverse_prefixed(tree, INDEX(child), 1, callback, baton);
+		if (ret != 0) {
+			return ret;
+		}
+		return 0;
+	}
+
+	return (callback)(cb32_key(tree, INDEX(child)),
+		cb32_keylen(tree, INDEX(child)), baton);
+}
+
+/*! Creates a new, empty compact critbit tree */
+cb32_tree_t cb32_tree_make()
+{
+	cb32_tree_t tree;
+	tree.nodes = NULL;
+	tree.keys = NULL;
+	tree.size = 0;
+	tree.capacity = 0;
+	tree.keys_used = 0;
+	tree.keys_capacity = 0;
+	tree.keys_garbage = 0;
+	tree.root = 0;
+	tree.malloc = &malloc_std;
+	tree.free = &free_std;
+	tree.baton = NULL;
+	return tree;
+}
+
+/*! Returns non-zero if tree contains str */
+int cb32_tree_contains(cb32_tree_t *tree, const char *str)
+{
+	return cb32_tree_contains_n(tree, str, strlen(str));
+}
+
+/*! Returns non-zero if tree contains the len bytes at key */
+int cb32_tree_contains_n(cb32_tree_t *tree, const void *key, size_t len)
+{
+	const cb_byte_t *ubytes = (const cb_byte_t *)key;
+	const cb32_node_t *nodes = tree->nodes;
+	cb32_index_t child;
+
+	if (tree->size == 0) {
+		return 0;
+	}
+
+	child = nodes[tree->root].child[ROOT_DIRECTION];
+	while (!IS_LEAF(child)) {
+		const cb32_node_t *q = &nodes[INDEX(child)];
+		child = q->child[cb32_direction(q, ubytes, len)];
+	}
+
+	return cb32_keylen(tree, INDEX(child)) == len &&
+		memcmp(ubytes, cb32_key(tree, INDEX(child)), len) == 0;
+}
+
+/*! Inserts str into tree, returns 0 on success */
+int cb32_tree_insert(cb32_tree_t *tree, const char *str)
+{
+	return cb32_tree_insert_n(tree, str, strlen(str));
+}
+
+/*! Inserts the len bytes at key into tree, returns 0 on success */
+int cb32_tree_insert_n(cb32_tree_t *tree, const void *key, size_t len)
+{
+	const cb_byte_t *ubytes = (const cb_byte_t *)key;
+	cb32_node_t *nodes;
+	cb32_node_t *newnode;
+	cb32_index_t newleaf;
+	char *record;
+	const cb_byte_t *lbytes;
+	size_t i, p, llen, clen;
+	size_t newbyte;
+	unsigned int newotherbits;
+	int direction, newdirection;
+	int res;
+
+	if (len > MAX_KEYLEN) {
+		return EINVAL;
+	}
+	res = cb32_reserve(tree, len);
+	if (res != 0) {
+		return res;
+	}
+
+	nodes = tree->nodes;
+	i = tree->size;
+	newnode = &nodes[i];
+	newleaf = LEAF_CHILD(tree->keys_used / LEN_SIZE);
+
+	if (tree->size == 0) {
+		memset(newnode, 0, sizeof(*newnode));
+		newnode->child[ROOT_DIRECTION] = newleaf;
+		tree->root = i;
+	}
+	else {
+		p = tree->root;
+		direction = ROOT_DIRECTION;
+		while (!IS_LEAF(nodes[p].child[direction])) {
+			p = INDEX(nodes[p].child[direction]);
+			direction = cb32_direction(&nodes[p], ubytes, len);
+		}
+
+		lbytes = cb32_key(tree, INDEX(nodes[p].child[direction]));
+		llen = cb32_keylen(tree, INDEX(nodes[p].child[direction]));
+
+		/* compare the new key with the leaf, as in critbit.c */
+		if (llen < len) {
+			clen = llen;
+			newdirection = 0;
+			newotherbits = PREFIX_MASK;
+		}
+		else if (len < llen) {
+			clen = len;
+			newdirection = 1;
+			newotherbits = PREFIX_MASK;
+		}
+		else {
+			clen = len;
+			newdirection = 0;
+			newotherbits = 0;
+		}
+
+		for (newbyte = 0; newbyte < clen; ++newbyte) {
+			if (lbytes[newbyte] != ubytes[newbyte]) {
+				newotherbits = lbytes[newbyte] ^ ubytes[newbyte];
+				newotherbits |= newotherbits >> 1;
+				newotherbits |= newotherbits >> 2;
+				newotherbits |= newotherbits >> 4;
+				newotherbits = (newotherbits ^ 255) | (newotherbits >> 1);
+				newdirection = (1 + (newotherbits | lbytes[newbyte])) >> 8;
+				break;
+			}
+		}
+
+		if (newotherbits == 0) {
+			return 1;
+		}
+
+		newnode->crit = (cb32_index_t)newbyte << 8 | newotherbits;
+		newnode->child[1 - newdirection] = newleaf;
+
+		/* Insert into tree, ordering prefix masks first */
+		p = tree->root;
+		direction = ROOT_DIRECTION;
+		newotherbits = (newotherbits + 1) & 0xff;
+
+		while (!IS_LEAF(nodes[p].child[direction])) {
+			size_t q = INDEX(nodes[p].child[direction]);
+			if (BYTE(&nodes[q]) > newbyte || (BYTE(&nodes[q]) == newbyte &&
+					((OTHERBITS(&nodes[q]) + 1) & 0xff) > newotherbits)) {
+				break;
+			}
+			direction = cb32_direction(&nodes[q], ubytes, len);
+			p = q;
+		}
+
+		newnode->child[newdirection] = nodes[p].child[direction];
+		nodes[p].child[direction] = NODE_CHILD(i);
+	}
+
+	record = tree->keys + tree->keys_used;
+	((cb32_index_t *)record)[0] = (cb32_index_t)len;
+	memcpy(record + LEN_SIZE, ubytes, len);
+	memset(record + LEN_SIZE + len, 0, RECORD_SIZE(len) - LEN_SIZE - len);
+	tree->keys_used += RECORD_SIZE(len);
+	tree->size++;
+	return 0;
+}
+
+/*! Deletes str from the tree, returns 0 on success */
+int cb32_tree_delete(cb32_tree_t *tree, const char *str)
+{
+	return cb32_tree_delete_n(tree, str, strlen(str));
+}
+
+/*! Deletes the len bytes at key from the tree, returns 0 on success */
+int cb32_tree_delete_n(cb32_tree_t *tree, const void *key, size_t len)
+{
+	const cb_byte_t *ubytes = (const cb_byte_t *)key;
+	cb32_node_t *nodes = tree->nodes;
+	size_t p, q, record;
+	int direction, pdirection;
+	int has_parent = 0;
+
+	if (tree->size == 0) {
+		return 1;
+	}
+
+	p = q = tree->root;
+	pdirection = direction = ROOT_DIRECTION;
+	while (!IS_LEAF(nodes[q].child[direction])) {
+		p = q;
+		pdirection = direction;
+		has_parent = 1;
+		q = INDEX(nodes[q].child[direction]);
+		direction = cb32_direction(&nodes[q], ubytes, len);
+	}
+
+	record = INDEX(nodes[q].child[direction]);
+	if (cb32_keylen(tree, record) != len ||
+			memcmp(ubytes, cb32_key(tree, record), len) != 0) {
+		return 1;
+	}
+
+	if (!has_parent) {
+		tree->size = 0;
+		tree->keys_used = 0;
+		tree->keys_garbage = 0;
+		return 0;
+	}
+
+	/* Unlink q and fill its hole with the last node */
+	nodes[p].child[pdirection] = nodes[q].child[1 - direction];
+	tree->keys_garbage += RECORD_SIZE(len);
+	tree->size--;
+	if (q != tree->size) {
+		cb32_move_node(tree, tree->size, q);
+	}
+	return 0;
+}
+
+/*! Clears the given tree */
+void cb32_tree_clear(cb32_tree_t *tree)
+{
+	if (tree->nodes != NULL) {
+		tree->free(tree->nodes, tree->baton);
+	}
+	if (tree->keys != NULL) {
+		tree->free(tree->keys, tree->baton);
+	}
+	tree->nodes = NULL;
+	tree->keys = NULL;
+	tree->size = 0;
+	tree->capacity = 0;
+	tree->keys_used = 0;
+	tree->keys_capacity = 0;
+	tree->keys_garbage = 0;
+	tree->root = 0;
+}
+
+struct callback32_str {
+	int (*callback)(const char *, void *);
+	void * baton;
+};
+
+static int callback32_str_wrapper(const void * key, size_t len, void * baton)
+{
+	struct callback32_str *param = (struct callback32_str *)baton;
+	(void)len; /* Prevent compiler warnings */
+	return param->callback((const char*)key, param->baton);
+}
+
+/*! Calls callback for all strings in tree with the given prefix */
+int cb32_tree_walk_prefixed(cb32_tree_t *tree, const char *prefix,
+	int (*callback)(const char *, void *), void *baton)
+{
+	struct callback32_str param;
+	param.callback = callback;
+	param.baton = baton;
+	return cb32_tree_walk_prefixed_n(tree, prefix, strlen(prefix),
+		callback32_str_wrapper, &param);
+}
+
+/*! Calls callback for all keys in tree starting with the len bytes at prefix */
+int cb32_tree_walk_prefixed_n(cb32_tree_t *tree, const void *prefix, size_t len,
+	int (*callback)(const void *, size_t, void *), void *baton)
+{
+	const cb_byte_t *ubytes = (const cb_byte_t *)prefix;
+	cb32_node_t *nodes = tree->nodes;
+	size_t p, top, record;
+	int direction, tdirection;
+
+	if (tree->size == 0) {
+		return 0;
+	}
+
+	top = p = tree->root;
+	tdirection = direction = ROOT_DIRECTION;
+
+	while (!IS_LEAF(nodes[p].child[direction])) {
+		size_t q = INDEX(nodes[p].child[direction]);
+		direction = 0;
+		if (BYTE(&nodes[q]) < len) {
+			direction = cb32_direction(&nodes[q], ubytes, len);
+			top = q;
+			tdirection = direction;
+		}
+		p = q;
+	}
+
+	record = INDEX(nodes[p].child[direction]);
+	if (cb32_keylen(tree, record) < len ||
+			memcmp(cb32_key(tree, record), ubytes, len) != 0) {
+		/* No strings match */
+		return 0;
+	}
+
+	return cbt32_traverse_prefixed(tree, top, tdirection, callback, baton);
+}
@@ -0,0 +1,75 @@
+/*
+ * critbit89 - A crit-bit tree implementation for strings in C89
+ * Written by Jonas Gehring <jonas@jgehring.net>
+ */
+
+
+#ifndef CRITBIT32_H_
+#define CRITBIT32_H_
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*! Compact variant of cb_tree_t: nodes and keys are stored in two
+ * contiguous arrays and refer to each other by 32-bit indices. A node
+ * takes 12 bytes and a key its length plus 5, rounded up to a multiple of
+ * 4, with up to a quarter of slack in each array, and there is no per-key
+ * allocation overhead. Keys are limited to 16 MiB each, and all keys of a
+ * tree to 8 GiB including that overhead; insertions beyond return ENOMEM.
+ * Key pointers passed to callbacks are only valid until the tree is
+ * modified. */
+typedef struct {
+	struct cb32_node_t *nodes;
+	char *keys;
+	size_t size; /*! Number of keys in the tree */
+	size_t capacity; /*! Number of nodes allocated */
+	size_t keys_used; /*! Bytes used in keys, including deleted keys */
+	size_t keys_capacity;
+	size_t keys_garbage; /*! Bytes of deleted keys in keys */
+	size_t root;
+	void *(*malloc)(size_t size, void *baton);
+	void (*free)(void *ptr, void *baton);
+	void *baton; /*! Passed to malloc() and free() */
+} cb32_tree_t;
+
+/*! Creates an new, empty compact critbit tree */
+extern cb32_tree_t cb32_tree_make();
+
+/*! Returns non-zero if tree contains str */
+extern int cb32_tree_contains(cb32_tree_t *tree, const char *str);
+
+/*! Returns non-zero if tree contains the len bytes at key */
+extern int cb32_tree_contains_n(cb32_tree_t *tree, const void *key, size_t len);
+
+/*! Inserts str into tree, returns 0 on success */
+extern int cb32_tree_insert(cb32_tree_t *tree, const char *str);
+
+/*! Inserts the len bytes at key into tree, returns 0 on success */
+extern int cb32_tree_insert_n(cb32_tree_t *tree, const void *key, size_t len);
+
+/*! Deletes str from the tree, returns 0 on success */
+extern int cb32_tree_delete(cb32_tree_t *tree, const char *str);
+
+/*! Deletes the len bytes at key from the tree, returns 0 on success */
+extern int cb32_tree_delete_n(cb32_tree_t *tree, const void *key, size_t len);
+
+/*! Clears the given tree */
+extern void cb32_tree_clear(cb32_tree_t *tree);
+
+/*! Calls callback for all strings in tree with the given prefix */
+extern int cb32_tree_walk_prefixed(cb32_tree_t *tree, const char *prefix,
+	int (*callback)(const char *, void *), void *baton);
+
+/*! Calls callback for all keys in tree starting with the len bytes at
+ * prefix, like cb_tree_walk_prefixed_n() */
+extern int cb32_tree_walk_prefixed_n(cb32_tree_t *tree, const void *prefix,
+	size_t len, int (*callback)(const void *, size_t, void *), void *baton);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CRITBIT32_H_ */
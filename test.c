@@ -4,13 +4,17 @@
  */
 
 
+#define _POSIX_C_SOURCE 200112L
+
 #include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
 #include "critbit.h"
+#include "critbit32.h"
 
 
 /*
@@ -166,6 +170,63 @@ static void test_allocator(cb_tree_t *unused)
 	}
 }
 
+/* Counting allocator */
+struct alloc_counts {
+	int allocs;
+	int frees;
+};
+
+static void *counting_malloc(size_t s, void *b)
+{
+	((struct alloc_counts *)b)->allocs++;
+	return malloc(s);
+}
+
+static void counting_free(void *p, void *b)
+{
+	((struct alloc_counts *)b)->frees++;
+	free(p);
+}
+
+static void check_counts(struct alloc_counts *counts, int allocs, int frees)
+{
+	if (counts->allocs != allocs || counts->frees != frees) {
+		fprintf(stderr, "%d allocations and %d frees expected, but got %d and %d\n",
+			allocs, frees, counts->allocs, counts->frees);
+		abort();
+	}
+}
+
+static void test_allocator_hooks(cb_tree_t *unused)
+{
+	struct alloc_counts counts = { 0, 0 };
+	cb_tree_t tree = cb_tree_make();
+	void *value;
+	tree.malloc = counting_malloc;
+	tree.free = counting_free;
+	tree.baton = &counts;
+
+	test_insert(&tree);
+	check_counts(&counts, dict_size, 0);
+	test_insert_dup(&tree);
+	check_counts(&counts, 2 * dict_size, dict_size);
+	if (cb_tree_insert_value(&tree, dict[0], sizeof(int), &value) != 1) {
+		fprintf(stderr, "Insertion of duplicate '%s' should fail\n", dict[0]);
+		abort();
+	}
+	check_counts(&counts, 2 * dict_size + 1, dict_size + 1);
+	test_delete(&tree);
+	check_counts(&counts, 2 * dict_size + 1, dict_size + 2);
+	cb_tree_clear(&tree);
+	check_counts(&counts, 2 * dict_size + 1, 2 * dict_size + 1);
+
+	test_insert(&tree);
+	test_delete_all(&tree);
+	check_counts(&counts, 3 * dict_size + 1, 3 * dict_size + 1);
+	cb_tree_clear(&tree);
+	check_counts(&counts, 3 * dict_size + 1, 3 * dict_size + 1);
+}
+
 /* Empty tree */
 static void test_empty(cb_tree_t *tree)
 {
@@ -179,6 +240,119 @@ static void test_empty(cb_tree_t *tree)
 	}
 }
 
+/* Arena allocator */
+static void test_arena(cb_tree_t *unused)
+{
+	cb_arena_t arena = cb_arena_make(256);
+	cb_tree_t tree = cb_tree_make();
+	cb_tree_use_arena(&tree, &arena);
+
+	test_insert(&tree);
+	test_complete(&tree, dict_size);
+	test_contains(&tree);
+	test_delete(&tree);
+	test_complete(&tree, dict_size - 1);
+	if (cb_tree_insert(&tree, "a key longer than a quarter of the arena chunk size, "
+			"which gets a chunk of its own") != 0) {
+		fprintf(stderr, "Insertion of long key failed\n");
+		abort();
+	}
+	test_complete(&tree, dict_size);
+
+	cb_tree_clear(&tree);
+	if (arena.chunks != NULL) {
+		fprintf(stderr, "Clearing the tree should free all arena chunks\n");
+		abort();
+	}
+	test_empty(&tree);
+	test_insert(&tree);
+	test_delete_all(&tree);
+	test_complete(&tree, 0);
+	cb_tree_clear(&tree);
+}
+
+/* Rank and select without counts walk the tree, which must not allocate
+ * from an arena */
+static void test_arena_rank(cb_tree_t *unused)
+{
+	cb_arena_t arena = cb_arena_make(256);
+	cb_tree_t tree = cb_tree_make();
+	const char *prev = NULL;
+	void *chunks;
+	size_t left;
+	int i;
+	cb_tree_use_arena(&tree, &arena);
+
+	test_insert(&tree);
+	chunks = arena.chunks;
+	left = arena.left;
+	for (i = 0; i < dict_size; i++) {
+		size_t len;
+		const char *key = (const char *)cb_tree_select(&tree, i, &len);
+		if (key == NULL || (prev != NULL && strcmp(prev, key) >= 0) ||
+				cb_tree_rank(&tree, key) != i) {
+			fprintf(stderr, "Wrong key of rank %d in arena tree\n", i);
+			abort();
+		}
+		prev = key;
+	}
+	if (arena.chunks != chunks || arena.left != left) {
+		fprintf(stderr, "Rank and select should not allocate from the arena\n");
+		abort();
+	}
+	cb_tree_clear(&tree);
+}
+
+/* Pool allocator */
+static void test_pool(cb_tree_t *unused)
+{
+	cb_arena_t arena = cb_arena_make(512);
+	cb_tree_t tree = cb_tree_make();
+	size_t misses;
+	char large[1024];
+	cb_tree_use_pool(&tree, &arena);
+
+	/* too long for the size classes, kept on the list of large blocks */
+	memset(large, 'x', sizeof(large) - 1);
+	large[sizeof(large) - 1] = '\0';
+
+	test_insert(&tree);
+	if (cb_tree_insert(&tree, large) != 0) {
+		fprintf(stderr, "Insertion of large key failed\n");
+		abort();
+	}
+	test_complete(&tree, dict_size + 1);
+	test_delete_all(&tree);
+	if (cb_tree_delete(&tree, large) != 0) {
+		fprintf(stderr, "Deletion of large key failed\n");
+		abort();
+	}
+	test_complete(&tree, 0);
+
+	misses = arena.misses;
+	test_insert(&tree);
+	if (cb_tree_insert(&tree, large) != 0) {
+		fprintf(stderr, "Insertion of large key failed\n");
+		abort();
+	}
+	test_complete(&tree, dict_size + 1);
+	test_contains(&tree);
+	if (arena.misses != misses || arena.hits != dict_size + 1) {
+		fprintf(stderr, "Reinsertion should reuse all blocks (%d hits, %d misses)\n",
+			(int)arena.hits, (int)(arena.misses - misses));
+		abort();
+	}
+
+	cb_tree_clear(&tree);
+	if (arena.chunks != NULL) {
+		fprintf(stderr, "Clearing the tree should free all arena chunks\n");
+		abort();
+	}
+	test_insert(&tree);
+	test_complete(&tree, dict_size);
+	cb_tree_clear(&tree);
+}
+
 /* Prefix walking */
 static void test_prefixes(cb_tree_t *tree)
 {
@@ -231,97 +405,1679 @@ static void test_prefixes(cb_tree_t *tree)
 	}
 }
 
-#define TESTRANDOM_RANGE 4096
-#define TESTRANDOM_LOOPS 100
+/* Values stored with keys */
+static void test_values(cb_tree_t *tree)
+{
+	int i;
+	void *value;
 
-char randombuf[TESTRANDOM_RANGE];
+	for (i = 0; i < dict_size; i++) {
+		if (cb_tree_insert_value(tree, dict[i], sizeof(double), &value) != 0) {
+			fprintf(stderr, "Insertion with value failed\n");
+			abort();
+		}
+		*(double *)value = i;
+	}
+	if (cb_tree_insert_value(tree, dict[7], sizeof(double), &value) != 1 ||
+			*(double *)value != 7) {
+		fprintf(stderr, "Duplicate insertion should return the existing value\n");
+		abort();
+	}
+	for (i = 0; i < dict_size; i++) {
+		value = cb_tree_get(tree, dict[i]);
+		if (value == NULL || *(double *)value != i) {
+			fprintf(stderr, "Wrong value for '%s'\n", dict[i]);
+			abort();
+		}
+	}
+	if (cb_tree_get(tree, "not in tree") != NULL) {
+		fprintf(stderr, "No value expected for missing key\n");
+		abort();
+	}
+	if (cb_tree_delete(tree, dict[7]) != 0 || cb_tree_get(tree, dict[7]) != NULL) {
+		fprintf(stderr, "No value expected for deleted key\n");
+		abort();
+	}
+}
 
-static void test_random (cb_tree_t *tree, int seed)
+/* Borrowed keys */
+static int same_cb(const char *s, void *n)
 {
 	int i;
-	int errors = 0;
-	int maxerrors = 5;
-	srand(seed);
-	for (i = 0; i < TESTRANDOM_RANGE * TESTRANDOM_LOOPS; i++) {
-		char key[10];
-		int v = rand() % TESTRANDOM_RANGE;
-		sprintf(key, "%x", v);
-		if (randombuf[v]) {
-			/* key should be inside the tree */
-			if (!cb_tree_contains(tree, key)) {
-				fprintf(stderr, "Random test (seed=%d): Tree should contain '%s'\n", seed, key);
-				if (errors++ > maxerrors) abort();
-			}
-			if (cb_tree_delete(tree, key) != 0) {
-				fprintf(stderr, "Random test (seed=%d): Deletion of '%s' failed\n", seed, key);
-				if (errors++ > maxerrors) abort();
-			}
-			if (cb_tree_contains(tree, key)) {
-				fprintf(stderr, "Random test (seed=%d): Tree should not contain '%s'\n", seed, key);
-				if (errors++ > maxerrors) abort();
-			}
-			randombuf[v] = 0;
+	for (i = 0; i < dict_size; i++) {
+		if (s == dict[i]) {
+			(*(int *)n)++;
 		}
-		else {
-			if (cb_tree_contains(tree, key)) {
-				fprintf(stderr, "Random test (seed=%d): Tree should not contain '%s'\n", seed, key);
-				if (errors++ > maxerrors) abort();
-			}
-			if (cb_tree_insert(tree, key) != 0) {
-				fprintf(stderr, "Random test (seed=%d): Insertion of '%s' failed\n", seed, key);
-				if (errors++ > maxerrors) abort();
-			}
-			if (!cb_tree_contains(tree, key)) {
-				fprintf(stderr, "Random test (seed=%d): Tree should contain '%s'\n", seed, key);
-				if (errors++ > maxerrors) abort();
-			}
-			randombuf[v] = 1;
+	}
+	return 0;
+}
+
+static void test_borrowed(cb_tree_t *tree)
+{
+	int i, n = 0;
+	void *value;
+
+	for (i = 0; i < dict_size; i++) {
+		if (cb_tree_insert_ref(tree, dict[i]) != 0) {
+			fprintf(stderr, "Insertion of borrowed key failed\n");
+			abort();
 		}
 	}
+	test_insert_dup(tree);
+	test_contains(tree);
+	if (cb_tree_walk_prefixed(tree, "", same_cb, &n) != 0 || n != dict_size) {
+		fprintf(stderr, "Walking should return the borrowed pointers\n");
+		abort();
+	}
+	if (cb_tree_insert_value_ref_n(tree, "not in tree", 6, sizeof(int), &value) != 0) {
+		fprintf(stderr, "Insertion of borrowed key with value failed\n");
+		abort();
+	}
+	*(int *)value = 42;
+	if (cb_tree_insert(tree, "not in") != 1 ||
+			*(int *)cb_tree_get_n(tree, "not in", 6) != 42) {
+		fprintf(stderr, "Borrowed key with value not found\n");
+		abort();
+	}
+	test_complete(tree, dict_size + 1);
+	test_delete_all(tree);
+	test_complete(tree, 1);
 }
 
-/* Program entry point */
-int main(int argc, char **argv)
+/* Keys with embedded zero bytes */
+static const char bin[] = "a\0b\0\0c";
+static const size_t binlens[] = { 0, 1, 2, 3, 4, 5, 6 };
+#define binlens_size (sizeof(binlens) / sizeof(size_t))
+
+static int count_n_cb(const void *k, size_t l, void *n) { (*(int *)n)++; return 0; }
+static void test_binary(cb_tree_t *tree)
 {
-	cb_tree_t tree = cb_tree_make();
+	int i, n;
 
-	printf("%d ", ++tnum); fflush(stdout);
-	test_insert(&tree);
+	for (i = 0; i < binlens_size; i++) {
+		if (cb_tree_insert_n(tree, bin, binlens[i]) != 0) {
+			fprintf(stderr, "Insertion of %d binary bytes failed\n", (int)binlens[i]);
+			abort();
+		}
+	}
+	if (cb_tree_insert_n(tree, bin, 3) == 0) {
+		fprintf(stderr, "Insertion of duplicate binary key should fail\n");
+		abort();
+	}
+	for (i = 0; i < binlens_size; i++) {
+		if (!cb_tree_contains_n(tree, bin, binlens[i])) {
+			fprintf(stderr, "Tree should contain %d binary bytes\n", (int)binlens[i]);
+			abort();
+		}
+	}
+	if (cb_tree_contains_n(tree, "a\0\0", 3) || cb_tree_contains_n(tree, bin, 7)) {
+		fprintf(stderr, "Tree should not contain unknown binary key\n");
+		abort();
+	}
 
-	printf("%d ", ++tnum); fflush(stdout);
-	test_complete(&tree, dict_size);
+	n = 0;
+	if (cb_tree_walk_prefixed_n(tree, bin, 2, count_n_cb, &n) != 0 || n != 5) {
+		fprintf(stderr, "5 binary keys expected, but %d walked\n", n);
+		abort();
+	}
+	n = 0;
+	if (cb_tree_walk_prefixed(tree, "a", count_cb, &n) != 0 || n != 6) {
+		fprintf(stderr, "6 binary keys expected, but %d walked\n", n);
+		abort();
+	}
 
-	printf("%d ", ++tnum); fflush(stdout);
-	test_insert_dup(&tree);
+	if (cb_tree_delete_n(tree, bin, 4) != 0 || cb_tree_delete_n(tree, bin, 4) == 0) {
+		fprintf(stderr, "Deletion of binary key failed\n");
+		abort();
+	}
+	if (cb_tree_contains_n(tree, bin, 4) || !cb_tree_contains_n(tree, bin, 5)) {
+		fprintf(stderr, "Deletion removed the wrong binary key\n");
+		abort();
+	}
+}
 
-	printf("%d ", ++tnum); fflush(stdout);
-	test_contains(&tree);
+/* Lengths beyond the key length limit are not truncated, and such keys
+ * sort after all keys that are their prefixes */
+static void test_long_lengths(cb_tree_t *tree)
+{
+	size_t lens[2];
+	int i;
 
-	printf("%d ", ++tnum); fflush(stdout);
-	test_delete(&tree);
+	lens[0] = (size_t)-1 / 2 + 2; /* 2^31 + 1 with a 32-bit size_t */
+	lens[1] = sizeof(size_t) > 4 ? (size_t)1 << (sizeof(size_t) * 4) | 1 : lens[0];
+	cb_tree_insert(tree, "a");
+	cb_tree_insert(tree, "b");
+	for (i = 0; i < 2; i++) {
+		size_t len = lens[i], foundlen;
+		const void *key = "a";
+		int result;
+		cb_cursor_t cursor = cb_cursor_make(tree);
+		if (cb_tree_contains_n(tree, key, len) || cb_tree_get_n(tree, key, len) != NULL ||
+				cb_tree_contains_batch(tree, &key, &len, 1, &result) != 0 || result ||
+				cb_tree_delete_n(tree, key, len) != 1 ||
+				cb_tree_insert_n(tree, key, len) != EINVAL ||
+				cb_tree_walk_prefixed_n(tree, key, len, count_n_cb, &result) != 0 ||
+				result != 0 || cb_tree_count_prefixed_n(tree, key, len) != 0) {
+			fprintf(stderr, "Key of %lu bytes should not be found\n", (unsigned long)len);
+			abort();
+		}
+		if (strcmp(cb_tree_longest_prefix_n(tree, key, len, &foundlen), "a") != 0 ||
+				strcmp(cb_tree_lower_bound_n(tree, key, len, &foundlen), "b") != 0 ||
+				strcmp(cb_tree_successor_n(tree, key, len, &foundlen), "b") != 0 ||
+				strcmp(cb_tree_predecessor_n(tree, key, len, &foundlen), "a") != 0 ||
+				cb_tree_rank_n(tree, key, len) != 1 ||
+				cb_cursor_seek_n(&cursor, key, len) != 0 ||
+				strcmp(cb_cursor_key(&cursor, &foundlen), "b") != 0) {
+			fprintf(stderr, "Key of %lu bytes should sort after 'a'\n", (unsigned long)len);
+			abort();
+		}
+		cb_cursor_free(&cursor);
+	}
+	test_complete(tree, 2);
+}
 
-	printf("%d ", ++tnum); fflush(stdout);
-	cb_tree_clear(&tree);
+/* Short and long keys sharing prefixes */
+static void test_prefix_chain(cb_tree_t *tree)
+{
+	static const char *chain = "abcdefghijklmnop";
+	const size_t n = strlen(chain);
+	size_t i, j;
 
-	test_insert(&tree);
-	test_complete(&tree, dict_size);
+	for (i = 0; i <= n; i++) {
+		if (cb_tree_insert_n(tree, chain, (i * 7) % (n + 1)) != 0) {
+			fprintf(stderr, "Insertion of prefix chain failed\n");
+			abort();
+		}
+	}
+	for (i = 0; i <= n; i++) {
+		size_t len = (i * 5) % (n + 1);
+		if (cb_tree_delete_n(tree, chain, len) != 0) {
+			fprintf(stderr, "Deletion of %d byte prefix failed\n", (int)len);
+			abort();
+		}
+		for (j = 0; j <= n; j++) {
+			int deleted = 0, k;
+			for (k = 0; k <= i; k++) {
+				deleted |= (k * 5) % (n + 1) == j;
+			}
+			if (cb_tree_contains_n(tree, chain, j) == deleted) {
+				fprintf(stderr, "Wrong result for %d byte prefix\n", (int)j);
+				abort();
+			}
+		}
+	}
+}
 
-	printf("%d ", ++tnum); fflush(stdout);
-	test_delete_all(&tree);
+/* Batched lookups */
+static void test_batch(cb_tree_t *tree)
+{
+	const void *keys[2 * dict_size + 1];
+	size_t lens[2 * dict_size + 1];
+	int results[2 * dict_size + 1];
+	int i, n = 2 * dict_size + 1;
 
-	printf("%d ", ++tnum); fflush(stdout);
-	test_complete(&tree, 0);
+	for (i = 0; i < dict_size; i++) {
+		keys[2 * i] = dict[i];
+		lens[2 * i] = strlen(dict[i]);
+		keys[2 * i + 1] = dict[i];
+		lens[2 * i + 1] = strlen(dict[i]) - 1;
+	}
+	keys[n - 1] = "";
+	lens[n - 1] = 0;
 
-	printf("%d ", ++tnum); fflush(stdout);
-	test_allocator(&tree);
+	if (cb_tree_contains_batch(tree, keys, lens, n, results) != 0) {
+		fprintf(stderr, "Batch lookup in empty tree should fail\n");
+		abort();
+	}
+	test_insert(tree);
+	if (cb_tree_contains_batch(tree, (const void *const *)dict, NULL,
+			dict_size, results) != dict_size) {
+		fprintf(stderr, "Batch lookup of all strings failed\n");
+		abort();
+	}
+	cb_tree_contains_batch(tree, keys, lens, n, results);
+	for (i = 0; i < n; i++) {
+		if (results[i] != cb_tree_contains_n(tree, keys[i], lens[i])) {
+			fprintf(stderr, "Batch lookup of '%.*s' failed\n", (int)lens[i],
+				(const char *)keys[i]);
+			abort();
+		}
+	}
+}
 
-	printf("%d ", ++tnum); fflush(stdout);
-	cb_tree_clear(&tree);
-	test_empty(&tree);
+/* Lexicographic comparison of byte strings, shorter prefixes first */
+static int keycmp(const void *a, size_t alen, const void *b, size_t blen)
+{
+	int r = memcmp(a, b, alen < blen ? alen : blen);
+	if (r != 0) {
+		return r;
+	}
+	return alen < blen ? -1 : alen > blen;
+}
 
-	printf("%d ", ++tnum); fflush(stdout);
-	test_insert(&tree);
-	test_prefixes(&tree);
+/* Returns the index of the smallest dict word not less than the probe */
+static int dict_lower_bound(const char *probe, size_t len)
+{
+	int i, best = -1;
+	for (i = 0; i < dict_size; i++) {
+		if (keycmp(dict[i], strlen(dict[i]), probe, len) >= 0 &&
+				(best < 0 || strcmp(dict[i], dict[best]) < 0)) {
+			best = i;
+		}
+	}
+	return best;
+}
+
+/* In-order cursor */
+static void test_cursor(cb_tree_t *tree)
+{
+	cb_cursor_t cursor = cb_cursor_make(tree);
+	const char *probes[] = { "", "a", "Tar", "Tarsius", "Tarsiusz", "mirk",
+		"mirksome", "mirksomf", "zz", "\377" };
+	const char *prev = NULL;
+	const void *key;
+	size_t len, plen = 0;
+	int i, n = 0;
+
+	if (cb_cursor_first(&cursor) != 1 || cb_cursor_seek(&cursor, "") != 1) {
+		fprintf(stderr, "Cursor on empty tree should fail\n");
+		abort();
+	}
+
+	test_insert(tree);
+	for (i = cb_cursor_first(&cursor); i == 0; i = cb_cursor_next(&cursor)) {
+		key = cb_cursor_key(&cursor, &len);
+		if (prev != NULL && keycmp(prev, plen, key, len) >= 0) {
+			fprintf(stderr, "Cursor keys out of order: '%s' after '%s'\n",
+				(const char *)key, prev);
+			abort();
+		}
+		prev = (const char *)key;
+		plen = len;
+		n++;
+	}
+	if (i != 1 || n != dict_size || cb_cursor_key(&cursor, &len) != NULL) {
+		fprintf(stderr, "Cursor visited %d of %d keys\n", n, (int)dict_size);
+		abort();
+	}
+
+	for (i = 0; i < (int)(sizeof(probes) / sizeof(probes[0])) + dict_size; i++) {
+		const char *probe = i < dict_size ? dict[i] : probes[i - dict_size];
+		size_t j;
+		for (j = 0; j <= strlen(probe); j++) {
+			int best = dict_lower_bound(probe, j);
+			int res = cb_cursor_seek_n(&cursor, probe, j);
+			key = cb_cursor_key(&cursor, &len);
+			if (best < 0 ? res != 1 || key != NULL :
+					res != 0 || key == NULL || strcmp(key, dict[best]) != 0) {
+				fprintf(stderr, "Seeking '%.*s' found '%s'\n", (int)j, probe,
+					key ? (const char *)key : "(none)");
+				abort();
+			}
+		}
+	}
+
+	/* Continue scanning after a seek */
+	n = 0;
+	for (i = cb_cursor_seek(&cursor, "m"); i == 0; i = cb_cursor_next(&cursor)) {
+		n++;
+	}
+	for (i = 0; i < dict_size; i++) {
+		n -= strcmp(dict[i], "m") >= 0;
+	}
+	if (n != 0) {
+		fprintf(stderr, "Cursor scan from 'm' visited the wrong keys\n");
+		abort();
+	}
+
+	/* Seeking among keys that are prefixes of each other */
+	srand(12);
+	for (i = 0; i < 2000; i++) {
+		char k[8];
+		sprintf(k, "%x", rand() % 4096);
+		cb_tree_insert_n(tree, k, 1 + rand() % strlen(k));
+	}
+	for (i = 0; i < 500; i++) {
+		char probe[8];
+		const void *found;
+		size_t flen;
+		int res;
+		sprintf(probe, "%x", rand() % 65536);
+		plen = rand() % (strlen(probe) + 1);
+		res = cb_cursor_seek_n(&cursor, probe, plen);
+		found = cb_cursor_key(&cursor, &flen);
+		for (n = cb_cursor_first(&cursor); n == 0; n = cb_cursor_next(&cursor)) {
+			key = cb_cursor_key(&cursor, &len);
+			if (keycmp(key, len, probe, plen) >= 0) {
+				break;
+			}
+		}
+		if (res != n || (res == 0 && key != found)) {
+			fprintf(stderr, "Seeking '%.*s' found the wrong key\n", (int)plen, probe);
+			abort();
+		}
+	}
+	cb_cursor_free(&cursor);
+}
+
+/* Cursor on a tree deeper than the stack embedded in cursors */
+#define DEEP_KEYS (2 * CB_CURSOR_DEPTH)
+static void test_deep_cursor(cb_tree_t *unused)
+{
+	struct alloc_counts counts = { 0, 0 };
+	cb_tree_t tree = cb_tree_make();
+	cb_cursor_t cursor;
+	char key[DEEP_KEYS + 1];
+	const void *found;
+	size_t len;
+	int i, n;
+	tree.malloc = counting_malloc;
+	tree.free = counting_free;
+	tree.baton = &counts;
+
+	/* "aa...ab" sorts before "a...ab", so the first key is the deepest */
+	memset(key, 'a', DEEP_KEYS);
+	for (i = 0; i < DEEP_KEYS; i++) {
+		key[i] = 'b';
+		cb_tree_insert_n(&tree, key, i + 1);
+		key[i] = 'a';
+	}
+	check_counts(&counts, DEEP_KEYS, 0);
+
+	cursor = cb_cursor_make(&tree);
+	n = DEEP_KEYS;
+	for (i = cb_cursor_first(&cursor); i == 0; i = cb_cursor_next(&cursor)) {
+		found = cb_cursor_key(&cursor, &len);
+		if (len != n || ((const char *)found)[n - 1] != 'b') {
+			fprintf(stderr, "Deep cursor found the wrong key\n");
+			abort();
+		}
+		n--;
+	}
+	if (i != 1 || n != 0 || cb_cursor_seek_n(&cursor, key, DEEP_KEYS) != 0) {
+		fprintf(stderr, "Deep cursor visited %d of %d keys\n", DEEP_KEYS - n, DEEP_KEYS);
+		abort();
+	}
+	cb_cursor_free(&cursor);
+	check_counts(&counts, DEEP_KEYS, 0);
+	cb_tree_clear(&tree);
+}
+
+/* Neighbor queries, checked against a scan of all keys */
+#define NEIGHBOR_KEYS 4000
+static void test_neighbors(cb_tree_t *tree)
+{
+	cb_cursor_t cursor = cb_cursor_make(tree);
+	const void *keys[NEIGHBOR_KEYS];
+	size_t lens[NEIGHBOR_KEYS];
+	size_t len;
+	int i, j, n = 0;
+
+	if (cb_tree_lower_bound(tree, "") != NULL || cb_tree_predecessor(tree, "a") != NULL) {
+		fprintf(stderr, "Neighbors in empty tree should not exist\n");
+		abort();
+	}
+
+	test_insert(tree);
+	srand(13);
+	for (i = 0; i < 2000; i++) {
+		char k[8];
+		sprintf(k, "%x", rand() % 4096);
+		cb_tree_insert_n(tree, k, 1 + rand() % strlen(k));
+	}
+	for (i = cb_cursor_first(&cursor); i == 0; i = cb_cursor_next(&cursor)) {
+		keys[n] = cb_cursor_key(&cursor, &lens[n]);
+		n++;
+	}
+	cb_cursor_free(&cursor);
+
+	for (i = 0; i < 1000 + n; i++) {
+		char buf[8];
+		const char *probe = buf;
+		size_t plen;
+		int lower = n, succ = n, pred = -1;
+		const void *k;
+
+		if (i < n) {
+			/* present keys and their neighbors */
+			probe = (const char *)keys[i];
+			plen = lens[i];
+		}
+		else {
+			sprintf(buf, "%x", rand() % 65536);
+			plen = rand() % (strlen(buf) + 1);
+		}
+		for (j = n - 1; j >= 0; j--) {
+			int r = keycmp(keys[j], lens[j], probe, plen);
+			if (r >= 0) {
+				lower = j;
+			}
+			if (r > 0) {
+				succ = j;
+			}
+			if (r < 0 && pred < 0) {
+				pred = j;
+			}
+		}
+
+		k = cb_tree_lower_bound_n(tree, probe, plen, &len);
+		if (lower < n ? k != keys[lower] || len != lens[lower] : k != NULL) {
+			fprintf(stderr, "Wrong lower bound of '%.*s'\n", (int)plen, probe);
+			abort();
+		}
+		k = cb_tree_successor_n(tree, probe, plen, &len);
+		if (succ < n ? k != keys[succ] || len != lens[succ] : k != NULL) {
+			fprintf(stderr, "Wrong successor of '%.*s'\n", (int)plen, probe);
+			abort();
+		}
+		k = cb_tree_predecessor_n(tree, probe, plen, &len);
+		if (pred >= 0 ? k != keys[pred] || len != lens[pred] : k != NULL) {
+			fprintf(stderr, "Wrong predecessor of '%.*s'\n", (int)plen, probe);
+			abort();
+		}
+	}
+}
+
+/* Range walks */
+struct range_check {
+	const char *lo, *hi;
+	int count, stop;
+};
+
+static int range_cb(const char *key, void *baton)
+{
+	struct range_check *r = (struct range_check *)baton;
+	if (strcmp(key, r->lo) < 0 || (r->hi && strcmp(key, r->hi) >= 0)) {
+		fprintf(stderr, "Key '%s' outside of range\n", key);
+		abort();
+	}
+	return ++r->count == r->stop ? -1 : 0;
+}
+
+static void test_range(cb_tree_t *tree)
+{
+	static const char *bounds[][2] = {
+		{ "", NULL }, { "b", "d" }, { "Tarsius", "Tarsius" },
+		{ "Tarsius", "Tarsiusa" }, { "m", "a" }, { "u", NULL }, { "", "" }
+	};
+	int i, j;
+
+	test_insert(tree);
+	for (i = 0; i < (int)(sizeof(bounds) / sizeof(bounds[0])); i++) {
+		struct range_check r;
+		int expected = 0;
+		r.lo = bounds[i][0];
+		r.hi = bounds[i][1];
+		r.count = 0;
+		r.stop = -1;
+		for (j = 0; j < dict_size; j++) {
+			expected += strcmp(dict[j], r.lo) >= 0 &&
+				(r.hi == NULL || strcmp(dict[j], r.hi) < 0);
+		}
+		if (cb_tree_walk_range(tree, r.lo, r.hi, range_cb, &r) != 0 ||
+				r.count != expected) {
+			fprintf(stderr, "Range walk from '%s' found %d of %d keys\n",
+				r.lo, r.count, expected);
+			abort();
+		}
+		if (expected > 2) {
+			r.count = 0;
+			r.stop = 2;
+			if (cb_tree_walk_range(tree, r.lo, r.hi, range_cb, &r) != -1 ||
+					r.count != 2) {
+				fprintf(stderr, "Range walk from '%s' did not stop\n", r.lo);
+				abort();
+			}
+		}
+	}
+}
+
+/* Longest prefix matches, checked against lookups of shrinking prefixes */
+static void test_longest_prefix(cb_tree_t *tree)
+{
+	size_t len;
+	int i;
+
+	if (cb_tree_longest_prefix(tree, "abc") != NULL) {
+		fprintf(stderr, "Longest prefix in empty tree should not exist\n");
+		abort();
+	}
+
+	srand(15);
+	for (i = 0; i < 1000; i++) {
+		char k[8];
+		sprintf(k, "%x", rand() % 65536);
+		cb_tree_insert_n(tree, k, rand() % (strlen(k) + 1));
+	}
+	for (i = 0; i < 5000; i++) {
+		char probe[8];
+		const void *found;
+		size_t plen, j;
+		sprintf(probe, "%x", rand() % 65536);
+		plen = rand() % (strlen(probe) + 1);
+		found = cb_tree_longest_prefix_n(tree, probe, plen, &len);
+		for (j = plen + 1; j-- > 0; ) {
+			if (cb_tree_contains_n(tree, probe, j)) {
+				break;
+			}
+		}
+		if (j == (size_t)-1 ? found != NULL :
+				found == NULL || len != j || memcmp(found, probe, j) != 0) {
+			fprintf(stderr, "Wrong longest prefix of '%.*s'\n", (int)plen, probe);
+			abort();
+		}
+	}
+	if (strcmp(cb_tree_longest_prefix(tree, "zzz"), "") != 0) {
+		fprintf(stderr, "The empty key should be a prefix of any key\n");
+		abort();
+	}
+}
+
+/* Subtree counts, checked against a tree without them */
+static void test_counts(cb_tree_t *tree)
+{
+	cb_tree_t ctree = cb_tree_make();
+	size_t len, clen;
+	int i;
+
+	cb_tree_use_counts(&ctree);
+	if (cb_tree_select(&ctree, 0, &len) != NULL || cb_tree_rank(&ctree, "a") != 0 ||
+			cb_tree_count_prefixed(&ctree, "") != 0) {
+		fprintf(stderr, "Counts of empty tree should be zero\n");
+		abort();
+	}
+
+	test_insert(&ctree);
+	test_insert(tree);
+	srand(16);
+	for (i = 0; i < 20000; i++) {
+		char k[8];
+		size_t klen;
+		sprintf(k, "%x", rand() % 4096);
+		klen = rand() % (strlen(k) + 1);
+		if (rand() % 3) {
+			cb_tree_insert_n(&ctree, k, klen);
+			cb_tree_insert_n(tree, k, klen);
+		}
+		else {
+			cb_tree_delete_n(&ctree, k, klen);
+			cb_tree_delete_n(tree, k, klen);
+		}
+	}
+	for (i = 0; i < dict_size; i += 2) {
+		cb_tree_delete(&ctree, dict[i]);
+		cb_tree_delete(tree, dict[i]);
+	}
+
+	for (i = 0; i < 2000; i++) {
+		char k[8];
+		size_t klen;
+		const void *a, *b;
+		sprintf(k, "%x", rand() % 65536);
+		klen = rand() % (strlen(k) + 1);
+		if (cb_tree_rank_n(&ctree, k, klen) != cb_tree_rank_n(tree, k, klen)) {
+			fprintf(stderr, "Wrong rank of '%.*s'\n", (int)klen, k);
+			abort();
+		}
+		if (cb_tree_count_prefixed_n(&ctree, k, klen) !=
+				cb_tree_count_prefixed_n(tree, k, klen)) {
+			fprintf(stderr, "Wrong count of prefix '%.*s'\n", (int)klen, k);
+			abort();
+		}
+		a = cb_tree_select(&ctree, i, &clen);
+		b = cb_tree_select(tree, i, &len);
+		if (a == NULL ? b != NULL : b == NULL || clen != len || memcmp(a, b, len) != 0) {
+			fprintf(stderr, "Wrong key with rank %d\n", i);
+			abort();
+		}
+		if (a != NULL && cb_tree_rank_n(&ctree, a, clen) != i) {
+			fprintf(stderr, "Rank of key with rank %d is wrong\n", i);
+			abort();
+		}
+	}
+	cb_tree_clear(&ctree);
+}
+
+/* Bulk load of sorted keys */
+static int strcmp_cb(const void *a, const void *b)
+{
+	return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+struct limited_counts {
+	struct alloc_counts counts;
+	int limit;
+};
+
+static void *limited_malloc(size_t s, void *b)
+{
+	struct limited_counts *l = (struct limited_counts *)b;
+	if (l->counts.allocs == l->limit) {
+		return NULL;
+	}
+	return counting_malloc(s, &l->counts);
+}
+
+static void limited_free(void *p, void *b)
+{
+	counting_free(p, &((struct limited_counts *)b)->counts);
+}
+
+static void test_build_sorted(cb_tree_t *tree)
+{
+	const char *sorted[dict_size + 1];
+	const char *swapped;
+	struct limited_counts limited;
+	cb_tree_t ctree = cb_tree_make();
+	int i;
+
+	memcpy(sorted, dict, sizeof(dict));
+	qsort(sorted, dict_size, sizeof(sorted[0]), strcmp_cb);
+
+	if (cb_tree_build_sorted(tree, (const void *const *)sorted, NULL, 0) != 0 ||
+			tree->root != NULL) {
+		fprintf(stderr, "Building from no keys should leave the tree empty\n");
+		abort();
+	}
+
+	/* Unsorted input and duplicates */
+	swapped = sorted[10];
+	sorted[10] = sorted[11];
+	sorted[11] = swapped;
+	if (cb_tree_build_sorted(tree, (const void *const *)sorted, NULL, dict_size) != EINVAL) {
+		fprintf(stderr, "Building from unsorted keys should fail\n");
+		abort();
+	}
+	sorted[11] = sorted[10];
+	if (cb_tree_build_sorted(tree, (const void *const *)sorted, NULL, dict_size) != EINVAL) {
+		fprintf(stderr, "Building from duplicate keys should fail\n");
+		abort();
+	}
+	sorted[11] = swapped;
+	qsort(sorted, dict_size, sizeof(sorted[0]), strcmp_cb);
+
+	/* Failing allocations */
+	limited.counts.allocs = 0;
+	limited.counts.frees = 0;
+	limited.limit = dict_size / 2;
+	ctree.malloc = limited_malloc;
+	ctree.free = limited_free;
+	ctree.baton = &limited;
+	if (cb_tree_build_sorted(&ctree, (const void *const *)sorted, NULL, dict_size) != ENOMEM ||
+			ctree.root != NULL) {
+		fprintf(stderr, "ENOMEM failure expected\n");
+		abort();
+	}
+	check_counts(&limited.counts, dict_size / 2, dict_size / 2);
+
+	/* The built tree must behave like one built by insertions */
+	if (cb_tree_build_sorted(tree, (const void *const *)sorted, NULL, dict_size) != 0) {
+		fprintf(stderr, "Building from sorted keys failed\n");
+		abort();
+	}
+	if (cb_tree_build_sorted(tree, (const void *const *)sorted, NULL, 1) != EINVAL) {
+		fprintf(stderr, "Building a non-empty tree should fail\n");
+		abort();
+	}
+	test_complete(tree, dict_size);
+	for (i = 0; i < dict_size; i++) {
+		size_t len;
+		const void *key = cb_tree_select(tree, i, &len);
+		if (key == NULL || strcmp(key, sorted[i]) != 0) {
+			fprintf(stderr, "Key %d of built tree is wrong\n", i);
+			abort();
+		}
+	}
+	test_delete_all(tree);
+	test_complete(tree, 0);
+
+	/* With subtree counts, and keys that are prefixes of each other */
+	ctree = cb_tree_make();
+	cb_tree_use_counts(&ctree);
+	sorted[0] = "";
+	sorted[1] = "a";
+	sorted[2] = "ab";
+	sorted[3] = "abc";
+	sorted[4] = "abd";
+	sorted[5] = "b";
+	if (cb_tree_build_sorted(&ctree, (const void *const *)sorted, NULL, 6) != 0) {
+		fprintf(stderr, "Building from sorted prefixes failed\n");
+		abort();
+	}
+	for (i = 0; i < 6; i++) {
+		if (cb_tree_rank(&ctree, sorted[i]) != i ||
+				cb_tree_count_prefixed(&ctree, sorted[i]) != (i == 0 ? 6 : i == 1 ? 4 : i == 2 ? 3 : 1)) {
+			fprintf(stderr, "Counts of built tree are wrong for '%s'\n", sorted[i]);
+			abort();
+		}
+	}
+	for (i = 5; i >= 0; i--) {
+		if (cb_tree_delete(&ctree, sorted[(i * 7) % 6]) != 0) {
+			fprintf(stderr, "Deletion from built tree failed\n");
+			abort();
+		}
+	}
+	cb_tree_clear(&ctree);
+}
+
+/* Batch insertion, checked against single insertions */
+static void test_insert_batch(cb_tree_t *tree)
+{
+	const char *sorted[dict_size];
+	char chain[100][101];
+	const void *keys[1000];
+	size_t lens[1000];
+	cb_tree_t ctree = cb_tree_make();
+	size_t inserted;
+	int i, j;
+
+	memcpy(sorted, dict, sizeof(dict));
+	qsort(sorted, dict_size, sizeof(sorted[0]), strcmp_cb);
+	if (cb_tree_insert_batch(tree, (const void *const *)sorted, NULL, dict_size,
+			&inserted) != 0 || inserted != dict_size) {
+		fprintf(stderr, "Batch insertion of sorted keys failed\n");
+		abort();
+	}
+	test_complete(tree, dict_size);
+	if (cb_tree_insert_batch(tree, (const void *const *)dict, NULL, dict_size,
+			&inserted) != 0 || inserted != 0) {
+		fprintf(stderr, "Batch insertion of duplicates should insert nothing\n");
+		abort();
+	}
+	test_delete_all(tree);
+
+	/* Deep chains of prefixes, longer than the recorded paths */
+	for (i = 0; i < 100; i++) {
+		memset(chain[i], 'a' + (i % 3 == 0), 100);
+		chain[i][i + 1] = 0;
+		keys[i] = chain[i];
+		lens[i] = i + 1;
+	}
+	if (cb_tree_insert_batch(tree, keys, lens, 100, &inserted) != 0 ||
+			inserted != 100) {
+		fprintf(stderr, "Batch insertion of long keys failed\n");
+		abort();
+	}
+	for (i = 0; i < 100; i++) {
+		if (!cb_tree_contains(tree, chain[i]) || cb_tree_delete(tree, chain[i]) != 0) {
+			fprintf(stderr, "Long key %d was not inserted\n", i);
+			abort();
+		}
+	}
+	test_complete(tree, 0);
+
+	/* Random batches with counts, in and out of order */
+	cb_tree_use_counts(&ctree);
+	srand(18);
+	for (i = 0; i < 20; i++) {
+		char k[1000][8];
+		size_t expected = 0;
+		for (j = 0; j < 1000; j++) {
+			sprintf(k[j], "%x", rand() % 65536);
+			keys[j] = k[j];
+			lens[j] = rand() % (strlen(k[j]) + 1);
+		}
+		if (i % 2) {
+			qsort(k, 1000, sizeof(k[0]), (int (*)(const void *, const void *))strcmp);
+		}
+		for (j = 0; j < 1000; j++) {
+			expected += cb_tree_insert_n(tree, keys[j], lens[j]) == 0;
+		}
+		if (cb_tree_insert_batch(&ctree, keys, lens, 1000, &inserted) != 0 ||
+				inserted != expected) {
+			fprintf(stderr, "Batch %d inserted %d of %d keys\n", i, (int)inserted,
+				(int)expected);
+			abort();
+		}
+		for (j = 0; j < 1000; j += 10) {
+			if (cb_tree_rank_n(&ctree, keys[j], lens[j]) != cb_tree_rank_n(tree, keys[j], lens[j])) {
+				fprintf(stderr, "Wrong rank after batch %d\n", i);
+				abort();
+			}
+		}
+	}
+	cb_tree_clear(&ctree);
+}
+
+/* Deletions in a tree deeper than the recorded search paths */
+static void test_deep_delete(cb_tree_t *unused)
+{
+	cb_tree_t tree = cb_tree_make();
+	char chain[200];
+	size_t len;
+	int i, j, order;
+
+	memset(chain, 'a', sizeof(chain));
+	cb_tree_use_counts(&tree);
+	for (order = 1; order < 4; order++) {
+		for (i = 0; i < 200; i++) {
+			cb_tree_insert_n(&tree, chain, (i * 7) % 200);
+		}
+		for (i = 0; i < 200; i++) {
+			int dlen = (i * (4 * order - 1)) % 200;
+			if (cb_tree_delete_n(&tree, chain, dlen) != 0) {
+				fprintf(stderr, "Deletion of %d byte chain failed\n", dlen);
+				abort();
+			}
+			if (cb_tree_count_prefixed(&tree, "") != 199 - i) {
+				fprintf(stderr, "Wrong count after deleting %d byte chain\n", dlen);
+				abort();
+			}
+			for (j = 0; j < 200; j += 13) {
+				if (cb_tree_contains_n(&tree, chain, j) !=
+						(cb_tree_select(&tree, cb_tree_rank_n(&tree, chain, j), &len) != NULL &&
+						len == j)) {
+					fprintf(stderr, "Wrong rank of %d byte chain\n", j);
+					abort();
+				}
+			}
+		}
+		test_complete(&tree, 0);
+	}
+	cb_tree_clear(&tree);
+}
+
+/* Retired blocks, freed once no lookup can reach them */
+struct retired {
+	struct alloc_counts counts; /* first, for counting_malloc() */
+	void *blocks[dict_size];
+	int n;
+};
+
+static void retire_cb(void *ptr, void *baton)
+{
+	struct retired *r = (struct retired *)baton;
+	r->blocks[r->n++] = ptr;
+}
+
+static void test_rcu(cb_tree_t *unused)
+{
+	cb_tree_t tree = cb_tree_make();
+	struct retired retired = { { 0, 0 }, { NULL }, 0 };
+	int i;
+
+	tree.malloc = counting_malloc;
+	tree.free = counting_free;
+	tree.baton = &retired;
+	cb_tree_use_rcu(&tree, retire_cb);
+
+	/* Deleted blocks are retired, the rest still freed */
+	for (i = 0; i < dict_size; i++) {
+		cb_tree_insert(&tree, dict[i]);
+	}
+	cb_tree_insert(&tree, dict[0]);
+	check_counts(&retired.counts, dict_size + 1, 1);
+	test_complete(&tree, dict_size);
+	for (i = 0; i < dict_size; i += 2) {
+		cb_tree_delete(&tree, dict[i]);
+	}
+	check_counts(&retired.counts, dict_size + 1, 1);
+	for (i = 0; i < dict_size; i++) {
+		if (cb_tree_contains(&tree, dict[i]) != (i % 2)) {
+			fprintf(stderr, "Wrong lookup of %s after deletion\n", dict[i]);
+			abort();
+		}
+	}
+	if (retired.n != (dict_size + 1) / 2 || tree.seq % 2 != 0) {
+		fprintf(stderr, "Wrong retirement after deletions\n");
+		abort();
+	}
+	for (i = 0; i < retired.n; i++) {
+		counting_free(retired.blocks[i], &retired.counts);
+	}
+	cb_tree_clear(&tree);
+	check_counts(&retired.counts, dict_size + 1, dict_size + 1);
+}
+
+/* Epoch-based reclamation, single-threaded */
+static void test_epoch(cb_tree_t *unused)
+{
+	cb_tree_t tree = cb_tree_make();
+	cb_epoch_t epoch = cb_epoch_make();
+	cb_epoch_reader_t reader;
+	struct alloc_counts counts = { 0, 0 };
+	cb_arena_t arena = cb_arena_make(0);
+	size_t misses;
+	int i;
+
+	tree.malloc = counting_malloc;
+	tree.free = counting_free;
+	tree.baton = &counts;
+	cb_tree_use_epoch(&tree, &epoch);
+	cb_epoch_register(&epoch, &reader);
+
+	/* Blocks stay allocated while an older reader is active */
+	test_insert(&tree);
+	cb_epoch_enter(&epoch, &reader);
+	for (i = 0; i < dict_size; i += 2) {
+		cb_tree_delete(&tree, dict[i]);
+	}
+	cb_epoch_reclaim(&epoch);
+	cb_epoch_reclaim(&epoch);
+	check_counts(&counts, dict_size + 1, 0);
+	cb_epoch_exit(&reader);
+	cb_epoch_reclaim(&epoch);
+	check_counts(&counts, dict_size + 1, (dict_size + 1) / 2);
+	test_complete(&tree, dict_size / 2);
+	cb_epoch_synchronize(&epoch);
+	check_counts(&counts, dict_size + 1, (dict_size + 1) / 2 + 1);
+	cb_tree_clear(&tree);
+	check_counts(&counts, dict_size + 1, dict_size + 1);
+
+	/* Reclaimed blocks go back to the pool of the tree */
+	tree = cb_tree_make();
+	epoch = cb_epoch_make();
+	cb_tree_use_pool(&tree, &arena);
+	cb_tree_use_epoch(&tree, &epoch);
+	test_insert(&tree);
+	test_delete_all(&tree);
+	cb_epoch_synchronize(&epoch);
+	misses = arena.misses;
+	test_insert(&tree);
+	test_complete(&tree, dict_size);
+	if (arena.misses != misses) {
+		fprintf(stderr, "Reinsertion should reuse reclaimed blocks\n");
+		abort();
+	}
+	cb_tree_clear(&tree);
+	if (arena.chunks != NULL || epoch.retired != NULL) {
+		fprintf(stderr, "Clearing the tree should free all arena chunks\n");
+		abort();
+	}
+}
+
+/* Readers running in parallel with a deleting writer */
+#define STRESS_READERS 4
+#define STRESS_UPDATES 20000
+
+struct stress_reader {
+	pthread_t thread;
+	cb_tree_t *tree;
+	cb_epoch_t *epoch;
+	cb_epoch_reader_t reader;
+	int lookups;
+	int missing; /* keys the writer never deletes, but were not found */
+};
+
+static volatile int stress_done;
+
+static void *stress_reader_main(void *arg)
+{
+	struct stress_reader *r = (struct stress_reader *)arg;
+	int i = 0;
+	while (!stress_done) {
+		cb_epoch_enter(r->epoch, &r->reader);
+		for (i = (i + 1) % dict_size; i % 16 != 0; i = (i + 1) % dict_size) {
+			int found = cb_tree_contains(r->tree, dict[i]);
+			if (i % 2 == 0 && !found) {
+				r->missing++;
+			}
+			r->lookups++;
+		}
+		cb_epoch_exit(&r->reader);
+	}
+	return NULL;
+}
+
+static void test_epoch_stress(cb_tree_t *unused)
+{
+	cb_tree_t tree = cb_tree_make();
+	cb_epoch_t epoch = cb_epoch_make();
+	struct alloc_counts counts = { 0, 0 };
+	struct stress_reader readers[STRESS_READERS];
+	int i;
+
+	tree.malloc = counting_malloc;
+	tree.free = counting_free;
+	tree.baton = &counts;
+	cb_tree_use_epoch(&tree, &epoch);
+	test_insert(&tree);
+
+	stress_done = 0;
+	for (i = 0; i < STRESS_READERS; i++) {
+		readers[i].tree = &tree;
+		readers[i].epoch = &epoch;
+		readers[i].lookups = 0;
+		readers[i].missing = 0;
+		cb_epoch_register(&epoch, &readers[i].reader);
+		pthread_create(&readers[i].thread, NULL, stress_reader_main, &readers[i]);
+	}
+
+	/* Only odd keys are deleted and reinserted, even ones stay */
+	for (i = 0; i < STRESS_UPDATES; i++) {
+		const char *key = dict[(i * 7 % dict_size) | 1];
+		if (cb_tree_delete(&tree, key) != 0 || cb_tree_insert(&tree, key) != 0) {
+			fprintf(stderr, "Update of %s failed\n", key);
+			abort();
+		}
+	}
+
+	stress_done = 1;
+	for (i = 0; i < STRESS_READERS; i++) {
+		pthread_join(readers[i].thread, NULL);
+		if (readers[i].missing != 0) {
+			fprintf(stderr, "%d lookups of stable keys failed\n", readers[i].missing);
+			abort();
+		}
+	}
+	cb_epoch_synchronize(&epoch);
+	test_complete(&tree, dict_size);
+	cb_tree_clear(&tree);
+	if (counts.allocs != counts.frees) {
+		fprintf(stderr, "%d blocks leaked\n", counts.allocs - counts.frees);
+		abort();
+	}
+}
+
+/* Several threads inserting the same keys in different orders */
+#define CONCURRENT_WRITERS 4
+#define CONCURRENT_KEYS 50000
+
+static char concurrent_keys[CONCURRENT_KEYS][8];
+
+struct concurrent_writer {
+	pthread_t thread;
+	cb_tree_t *tree;
+	int offset;
+	int inserted;
+};
+
+static void *concurrent_writer_main(void *arg)
+{
+	struct concurrent_writer *w = (struct concurrent_writer *)arg;
+	int i;
+	for (i = 0; i < CONCURRENT_KEYS; i++) {
+		int k = (w->offset + i * 7) % CONCURRENT_KEYS;
+		int res = cb_tree_insert(w->tree, concurrent_keys[k]);
+		if (res == 0) {
+			w->inserted++;
+		}
+		else if (res != 1 || !cb_tree_contains(w->tree, concurrent_keys[k])) {
+			fprintf(stderr, "Insertion of %s failed\n", concurrent_keys[k]);
+			abort();
+		}
+	}
+	return NULL;
+}
+
+static void test_concurrent_insert(cb_tree_t *tree)
+{
+	struct concurrent_writer writers[CONCURRENT_WRITERS];
+	cb_tree_t counted = cb_tree_make();
+	char chain[200];
+	int i, inserted = 0, count = 0;
+
+	cb_tree_use_counts(&counted);
+	if (cb_tree_use_concurrent_insert(&counted, 1) != EINVAL) {
+		fprintf(stderr, "Subtree counts should exclude concurrent insertion\n");
+		abort();
+	}
+
+	/* decimal numbers, many of them prefixes of others */
+	for (i = 0; i < CONCURRENT_KEYS; i++) {
+		sprintf(concurrent_keys[i], "%d", i);
+	}
+
+	if (cb_tree_use_concurrent_insert(tree, 1) != 0 || cb_tree_use_counts(tree) != EINVAL) {
+		fprintf(stderr, "Concurrent insertion should exclude subtree counts\n");
+		abort();
+	}
+	for (i = 0; i < CONCURRENT_WRITERS; i++) {
+		writers[i].tree = tree;
+		writers[i].offset = i;
+		writers[i].inserted = 0;
+		pthread_create(&writers[i].thread, NULL, concurrent_writer_main, &writers[i]);
+	}
+	for (i = 0; i < CONCURRENT_WRITERS; i++) {
+		pthread_join(writers[i].thread, NULL);
+		inserted += writers[i].inserted;
+	}
+
+	cb_tree_walk_prefixed(tree, "", count_cb, &count);
+	if (inserted != CONCURRENT_KEYS || count != CONCURRENT_KEYS) {
+		fprintf(stderr, "%d keys expected, but %d were inserted and %d found\n",
+			CONCURRENT_KEYS, inserted, count);
+		abort();
+	}
+	for (i = 0; i < CONCURRENT_KEYS; i++) {
+		if (!cb_tree_contains(tree, concurrent_keys[i])) {
+			fprintf(stderr, "Concurrently inserted %s not found\n", concurrent_keys[i]);
+			abort();
+		}
+	}
+
+	/* Deeper than the recorded search paths */
+	cb_tree_clear(tree);
+	memset(chain, 'a', sizeof(chain));
+	for (i = 0; i < 200; i++) {
+		cb_tree_insert_n(tree, chain, (i * 7) % 200);
+	}
+	for (i = 0; i < 200; i++) {
+		if (!cb_tree_contains_n(tree, chain, i)) {
+			fprintf(stderr, "Concurrently inserted %d byte chain not found\n", i);
+			abort();
+		}
+	}
+	test_complete(tree, 200);
+	cb_tree_use_concurrent_insert(tree, 0);
+}
+
+/* Sharded trees, checked against a single one */
+static void count_lock(void *lock) { (*(int *)lock)++; }
+static void count_unlock(void *lock) { (*(int *)lock)--; }
+
+static void test_sharded(cb_tree_t *tree)
+{
+	cb_sharded_t sharded;
+	cb_sharded_cursor_t scursor;
+	cb_cursor_t cursor;
+	int locks[3] = { 0, 0, 0 };
+	const char *prefixes[] = { "", "b", "T", "un", "zz" };
+	int i, res;
+
+	if (cb_sharded_init(&sharded, 0, 'a', 'z') != EINVAL ||
+			cb_sharded_init(&sharded, 3, 'z', 'a') != EINVAL) {
+		fprintf(stderr, "Invalid shard configurations should fail\n");
+		abort();
+	}
+	if (cb_sharded_init(&sharded, 3, 'a', 'z') != 0) {
+		fprintf(stderr, "Sharding failed\n");
+		abort();
+	}
+	sharded.lock = count_lock;
+	sharded.unlock = count_unlock;
+	for (i = 0; i < 3; i++) {
+		sharded.shards[i].lock = &locks[i];
+	}
+
+	for (i = 0; i < dict_size; i++) {
+		cb_tree_insert(tree, dict[i]);
+		cb_sharded_insert(&sharded, dict[i]);
+	}
+	cb_tree_insert(tree, "");
+	cb_sharded_insert(&sharded, "");
+	if (cb_sharded_insert(&sharded, dict[0]) != 1) {
+		fprintf(stderr, "Insertion of duplicate '%s' should fail\n", dict[0]);
+		abort();
+	}
+	for (i = 0; i < 3; i++) {
+		if (cb_tree_count_prefixed(&sharded.shards[i].tree, "") < 10 || locks[i] != 0) {
+			fprintf(stderr, "Unbalanced shards or locks\n");
+			abort();
+		}
+	}
+
+	/* In-order cursor across the shards */
+	cursor = cb_cursor_make(tree);
+	scursor = cb_sharded_cursor_make(&sharded);
+	res = cb_cursor_first(&cursor);
+	if (cb_sharded_cursor_first(&scursor) != res) {
+		fprintf(stderr, "Sharded cursor should start like the tree cursor\n");
+		abort();
+	}
+	while (res == 0) {
+		size_t len, slen;
+		const void *key = cb_cursor_key(&cursor, &len);
+		const void *skey = cb_sharded_cursor_key(&scursor, &slen);
+		if (skey == NULL || keycmp(key, len, skey, slen) != 0) {
+			fprintf(stderr, "Sharded cursor out of order at '%s'\n", (const char *)key);
+			abort();
+		}
+		res = cb_cursor_next(&cursor);
+		if (cb_sharded_cursor_next(&scursor) != res) {
+			fprintf(stderr, "Sharded cursor should end like the tree cursor\n");
+			abort();
+		}
+	}
+	for (i = 0; i < dict_size; i++) {
+		size_t len;
+		const char *lower = cb_tree_lower_bound(tree, dict[i] + 1);
+		res = cb_sharded_cursor_seek(&scursor, dict[i] + 1);
+		if ((lower == NULL) != (res == 1) ||
+				(lower != NULL && strcmp(lower, cb_sharded_cursor_key(&scursor, &len)) != 0)) {
+			fprintf(stderr, "Sharded seek to '%s' failed\n", dict[i] + 1);
+			abort();
+		}
+	}
+	cb_sharded_cursor_free(&scursor);
+	cb_cursor_free(&cursor);
+
+	/* Prefix walks */
+	for (i = 0; i < sizeof(prefixes) / sizeof(prefixes[0]); i++) {
+		int n = 0, sn = 0;
+		cb_tree_walk_prefixed(tree, prefixes[i], count_cb, &n);
+		cb_sharded_walk_prefixed(&sharded, prefixes[i], count_cb, &sn);
+		if (n != sn) {
+			fprintf(stderr, "%d keys with prefix '%s' expected, but got %d\n",
+				n, prefixes[i], sn);
+			abort();
+		}
+	}
+
+	for (i = 0; i < dict_size; i++) {
+		if (!cb_sharded_contains(&sharded, dict[i]) ||
+				cb_sharded_delete(&sharded, dict[i]) != 0 ||
+				cb_sharded_contains(&sharded, dict[i])) {
+			fprintf(stderr, "Sharded deletion of '%s' failed\n", dict[i]);
+			abort();
+		}
+	}
+	res = 0;
+	cb_sharded_walk_prefixed(&sharded, "", count_cb, &res);
+	if (res != 1 || locks[0] != 0 || locks[1] != 0 || locks[2] != 0) {
+		fprintf(stderr, "Only the empty key should be left\n");
+		abort();
+	}
+	cb_sharded_free(&sharded);
+}
+
+/* Persistent trees and their snapshots */
+#define VERSIONS 8
+#define VERSION_KEYS 300
+
+static void check_version(cb_tree_t *version, const char *present)
+{
+	int i, count = 0;
+	for (i = 0; i < VERSION_KEYS; i++) {
+		char key[10];
+		sprintf(key, "%x", i * 7);
+		if (cb_tree_contains(version, key) != present[i]) {
+			fprintf(stderr, "Version should %scontain '%s'\n", present[i] ? "" : "not ", key);
+			abort();
+		}
+		count += present[i];
+	}
+	test_complete(version, count);
+}
+
+static void test_persistent(cb_tree_t *unused)
+{
+	struct limited_counts limited = { { 0, 0 }, -1 };
+	cb_tree_t tree = cb_tree_make();
+	cb_tree_t versions[VERSIONS], snapshot;
+	cb_epoch_t epoch;
+	char present[VERSIONS + 1][VERSION_KEYS];
+	size_t inserted;
+	int i, j;
+
+	tree.malloc = limited_malloc;
+	tree.free = limited_free;
+	tree.baton = &limited;
+
+	/* Persistence needs an empty tree without subtree counts */
+	cb_tree_insert(&tree, dict[0]);
+	snapshot = cb_tree_snapshot(&tree);
+	if (snapshot.root != NULL || !cb_tree_contains(&tree, dict[0])) {
+		fprintf(stderr, "Snapshots of a non-persistent tree should be empty\n");
+		abort();
+	}
+	if (cb_tree_use_persistent(&tree) != EINVAL || cb_tree_use_counts(&tree) != EINVAL) {
+		fprintf(stderr, "Modes of a non-empty tree should not change\n");
+		abort();
+	}
+	cb_tree_clear(&tree);
+	if (cb_tree_use_persistent(&tree) != 0 || cb_tree_use_counts(&tree) != EINVAL) {
+		fprintf(stderr, "Persistent trees should exclude subtree counts\n");
+		abort();
+	}
+	snapshot = cb_tree_make();
+	cb_tree_use_counts(&snapshot);
+	if (cb_tree_use_persistent(&snapshot) != EINVAL) {
+		fprintf(stderr, "Subtree counts should exclude persistence\n");
+		abort();
+	}
+	epoch = cb_epoch_make();
+	if (cb_tree_use_rcu(&tree, retire_cb) != EINVAL ||
+			cb_tree_use_epoch(&tree, &epoch) != EINVAL || tree.malloc != limited_malloc) {
+		fprintf(stderr, "Persistent trees should exclude RCU mode\n");
+		abort();
+	}
+	limited.counts.allocs = limited.counts.frees = 0;
+
+	/* Without snapshots, nothing is copied */
+	test_insert(&tree);
+	test_delete_all(&tree);
+	check_counts(&limited.counts, dict_size, dict_size);
+
+	/* Snapshots of a tree with random updates keep their keys */
+	memset(present, 0, sizeof(present));
+	srand(7);
+	for (i = 0; i < VERSIONS; i++) {
+		for (j = 0; j < VERSION_KEYS; j++) {
+			int k = rand() % VERSION_KEYS;
+			char key[10];
+			sprintf(key, "%x", k * 7);
+			if (present[VERSIONS][k]) {
+				cb_tree_delete(&tree, key);
+			}
+			else {
+				cb_tree_insert(&tree, key);
+			}
+			present[VERSIONS][k] ^= 1;
+		}
+		versions[i] = cb_tree_snapshot(&tree);
+		memcpy(present[i], present[VERSIONS], VERSION_KEYS);
+	}
+	for (i = 0; i < VERSIONS; i++) {
+		check_version(&versions[i], present[i]);
+	}
+
+	/* Snapshots can be modified independently */
+	for (j = 0; j < VERSION_KEYS; j += 2) {
+		char key[10];
+		sprintf(key, "%x", j * 7);
+		if (present[0][j]) {
+			cb_tree_delete(&versions[0], key);
+		}
+		else {
+			cb_tree_insert(&versions[0], key);
+		}
+		present[0][j] ^= 1;
+	}
+	for (i = 0; i < VERSIONS; i++) {
+		check_version(&versions[i], present[i]);
+	}
+	check_version(&tree, present[VERSIONS]);
+
+	/* Failed copies leave the tree unchanged */
+	snapshot = cb_tree_snapshot(&tree);
+	limited.limit = limited.counts.allocs;
+	for (j = 0; j < VERSION_KEYS; j++) {
+		char key[10];
+		sprintf(key, "%x", j * 7);
+		if (present[VERSIONS][j] && cb_tree_delete(&tree, key) != ENOMEM) {
+			fprintf(stderr, "Deletion from a shared tree should need memory\n");
+			abort();
+		}
+	}
+	check_version(&tree, present[VERSIONS]);
+	limited.limit = -1;
+	if (cb_tree_insert_batch(&tree, (const void *const *)dict, NULL, dict_size, &inserted) != 0 ||
+			inserted != dict_size || cb_tree_build_sorted(&snapshot, NULL, NULL, 0) != EINVAL) {
+		fprintf(stderr, "Batch insertion into a persistent tree failed\n");
+		abort();
+	}
+	check_version(&snapshot, present[VERSIONS]);
+
+	/* Every node and key is freed with the last version using it */
+	cb_tree_clear(&snapshot);
+	for (i = VERSIONS - 1; i >= 0; i -= 2) {
+		cb_tree_clear(&versions[i]);
+	}
+	test_contains(&tree);
+	cb_tree_clear(&tree);
+	for (i = 0; i < VERSIONS; i += 2) {
+		check_version(&versions[i], present[i]);
+		cb_tree_clear(&versions[i]);
+	}
+	if (limited.counts.allocs != limited.counts.frees) {
+		fprintf(stderr, "%d blocks leaked\n", limited.counts.allocs - limited.counts.frees);
+		abort();
+	}
+}
+
+/* Compact tree, checked against the pointer-based one */
+static void test_compact(cb_tree_t *tree)
+{
+	struct alloc_counts counts = { 0, 0 };
+	cb32_tree_t ctree = cb32_tree_make();
+	int i, n = 0, m = 0;
+	ctree.malloc = counting_malloc;
+	ctree.free = counting_free;
+	ctree.baton = &counts;
+
+	test_insert(tree);
+	for (i = 0; i < dict_size; i++) {
+		if (cb32_tree_insert(&ctree, dict[i]) != 0) {
+			fprintf(stderr, "Compact insertion of '%s' failed\n", dict[i]);
+			abort();
+		}
+	}
+	for (i = 0; i < dict_size; i++) {
+		if (cb32_tree_insert(&ctree, dict[i]) != 1) {
+			fprintf(stderr, "Compact insertion of duplicate '%s' should fail\n", dict[i]);
+			abort();
+		}
+		if (!cb32_tree_contains(&ctree, dict[i])) {
+			fprintf(stderr, "Compact tree should contain '%s'\n", dict[i]);
+			abort();
+		}
+	}
+	cb32_tree_walk_prefixed(&ctree, "", count_cb, &n);
+	if (n != dict_size) {
+		fprintf(stderr, "Compact walk found %d of %d keys\n", n, (int)dict_size);
+		abort();
+	}
+
+	/* Random churn on short keys that are often prefixes of each other */
+	srand(10);
+	for (i = 0; i < 50000; i++) {
+		char key[8];
+		int len = rand() % 4;
+		sprintf(key, "%x", rand() % 4096);
+		len = strlen(key) - len % strlen(key);
+		if (rand() % 2) {
+			if (cb32_tree_insert_n(&ctree, key, len) != cb_tree_insert_n(tree, key, len)) {
+				fprintf(stderr, "Compact insertion of '%.*s' differs\n", len, key);
+				abort();
+			}
+		}
+		else if (cb32_tree_delete_n(&ctree, key, len) != cb_tree_delete_n(tree, key, len)) {
+			fprintf(stderr, "Compact deletion of '%.*s' differs\n", len, key);
+			abort();
+		}
+		if (cb32_tree_contains_n(&ctree, key, len) != cb_tree_contains_n(tree, key, len)) {
+			fprintf(stderr, "Compact lookup of '%.*s' differs\n", len, key);
+			abort();
+		}
+	}
+	for (i = 0; i < dict_size; i++) {
+		if (cb32_tree_delete(&ctree, dict[i]) != 0) {
+			fprintf(stderr, "Compact deletion of '%s' failed\n", dict[i]);
+			abort();
+		}
+		cb_tree_delete(tree, dict[i]);
+	}
+	n = 0;
+	cb32_tree_walk_prefixed(&ctree, "a", count_cb, &n);
+	cb_tree_walk_prefixed(tree, "a", count_cb, &m);
+	if (n != m) {
+		fprintf(stderr, "Compact walk found %d keys, expected %d\n", n, m);
+		abort();
+	}
+
+	cb32_tree_clear(&ctree);
+	if (counts.allocs != counts.frees) {
+		fprintf(stderr, "%d allocations but %d frees\n", counts.allocs, counts.frees);
+		abort();
+	}
+}
+
+#define TESTRANDOM_RANGE 4096
+#define TESTRANDOM_LOOPS 100
+
+char randombuf[TESTRANDOM_RANGE];
+
+static void test_random (cb_tree_t *tree, int seed)
+{
+	int i;
+	int errors = 0;
+	int maxerrors = 5;
+	srand(seed);
+	for (i = 0; i < TESTRANDOM_RANGE * TESTRANDOM_LOOPS; i++) {
+		char key[10];
+		int v = rand() % TESTRANDOM_RANGE;
+		sprintf(key, "%x", v);
+		if (randombuf[v]) {
+			/* key should be inside the tree */
+			if (!cb_tree_contains(tree, key)) {
+				fprintf(stderr, "Random test (seed=%d): Tree should contain '%s'\n", seed, key);
+				if (errors++ > maxerrors) abort();
+			}
+			if (cb_tree_delete(tree, key) != 0) {
+				fprintf(stderr, "Random test (seed=%d): Deletion of '%s' failed\n", seed, key);
+				if (errors++ > maxerrors) abort();
+			}
+			if (cb_tree_contains(tree, key)) {
+				fprintf(stderr, "Random test (seed=%d): Tree should not contain '%s'\n", seed, key);
+				if (errors++ > maxerrors) abort();
+			}
+			randombuf[v] = 0;
+		}
+		else {
+			if (cb_tree_contains(tree, key)) {
+				fprintf(stderr, "Random test (seed=%d): Tree should not contain '%s'\n", seed, key);
+				if (errors++ > maxerrors) abort();
+			}
+			if (cb_tree_insert(tree, key) != 0) {
+				fprintf(stderr, "Random test (seed=%d): Insertion of '%s' failed\n", seed, key);
+				if (errors++ > maxerrors) abort();
+			}
+			if (!cb_tree_contains(tree, key)) {
+				fprintf(stderr, "Random test (seed=%d): Tree should contain '%s'\n", seed, key);
+				if (errors++ > maxerrors) abort();
+			}
+			randombuf[v] = 1;
+		}
+	}
+}
+
+/* Program entry point */
+int main(int argc, char **argv)
+{
+	cb_tree_t tree = cb_tree_make();
+
+	printf("%d ", ++tnum); fflush(stdout);
+	test_insert(&tree);
+
+	printf("%d ", ++tnum); fflush(stdout);
+	test_complete(&tree, dict_size);
+
+	printf("%d ", ++tnum); fflush(stdout);
+	test_insert_dup(&tree);
+
+	printf("%d ", ++tnum); fflush(stdout);
+	test_contains(&tree);
+
+	printf("%d ", ++tnum); fflush(stdout);
+	test_delete(&tree);
+
+	printf("%d ", ++tnum); fflush(stdout);
+	cb_tree_clear(&tree);
+
+	test_insert(&tree);
+	test_complete(&tree, dict_size);
+
+	printf("%d ", ++tnum); fflush(stdout);
+	test_delete_all(&tree);
+
+	printf("%d ", ++tnum); fflush(stdout);
+	test_complete(&tree, 0);
+
+	printf("%d ", ++tnum); fflush(stdout);
+	test_allocator(&tree);
+
+	printf("%d ", ++tnum); fflush(stdout);
+	test_allocator_hooks(&tree);
+
+	printf("%d ", ++tnum); fflush(stdout);
+	test_arena(&tree);
+
+	printf("%d ", ++tnum); fflush(stdout);
+	test_arena_rank(&tree);
+
+	printf("%d ", ++tnum); fflush(stdout);
+	test_pool(&tree);
+
+	printf("%d ", ++tnum); fflush(stdout);
+	cb_tree_clear(&tree);
+	test_empty(&tree);
+
+	printf("%d ", ++tnum); fflush(stdout);
+	test_insert(&tree);
+	test_prefixes(&tree);
+
+	printf("%d ", ++tnum); fflush(stdout);
+	cb_tree_clear(&tree);
+	test_binary(&tree);
+
+	printf("%d ", ++tnum); fflush(stdout);
+	cb_tree_clear(&tree);
+	test_long_lengths(&tree);
+
+	printf("%d ", ++tnum); fflush(stdout);
+	cb_tree_clear(&tree);
+	test_prefix_chain(&tree);
+
+	printf("%d ", ++tnum); fflush(stdout);
+	cb_tree_clear(&tree);
+	test_values(&tree);
+
+	printf("%d ", ++tnum); fflush(stdout);
+	cb_tree_clear(&tree);
+	test_borrowed(&tree);
+
+	printf("%d ", ++tnum); fflush(stdout);
+	cb_tree_clear(&tree);
+	test_compact(&tree);
+
+	printf("%d ", ++tnum); fflush(stdout);
+	cb_tree_clear(&tree);
+	test_batch(&tree);
+
+	printf("%d ", ++tnum); fflush(stdout);
+	cb_tree_clear(&tree);
+	test_cursor(&tree);
+
+	printf("%d ", ++tnum); fflush(stdout);
+	test_deep_cursor(&tree);
+
+	printf("%d ", ++tnum); fflush(stdout);
+	cb_tree_clear(&tree);
+	test_neighbors(&tree);
+
+	printf("%d ", ++tnum); fflush(stdout);
+	cb_tree_clear(&tree);
+	test_range(&tree);
+
+	printf("%d ", ++tnum); fflush(stdout);
+	cb_tree_clear(&tree);
+	test_longest_prefix(&tree);
+
+	printf("%d ", ++tnum); fflush(stdout);
+	cb_tree_clear(&tree);
+	test_counts(&tree);
+
+	printf("%d ", ++tnum); fflush(stdout);
+	cb_tree_clear(&tree);
+	test_build_sorted(&tree);
+
+	printf("%d ", ++tnum); fflush(stdout);
+	cb_tree_clear(&tree);
+	test_insert_batch(&tree);
+
+	printf("%d ", ++tnum); fflush(stdout);
+	test_deep_delete(&tree);
+
+	printf("%d ", ++tnum); fflush(stdout);
+	test_rcu(&tree);
+
+	printf("%d ", ++tnum); fflush(stdout);
+	test_epoch(&tree);
+
+	printf("%d ", ++tnum); fflush(stdout);
+	test_epoch_stress(&tree);
+
+	cb_tree_clear(&tree);
+	printf("%d ", ++tnum); fflush(stdout);
+	test_concurrent_insert(&tree);
+
+	cb_tree_clear(&tree);
+	printf("%d ", ++tnum); fflush(stdout);
+	test_sharded(&tree);
+
+	printf("%d ", ++tnum); fflush(stdout);
+	test_persistent(&tree);
 
 	cb_tree_clear(&tree);
 